@@ -18,6 +18,12 @@
 # error unsupported ISA __ISA__
 #endif
 
+// Drivers that put descriptors in memory and then write a device register
+// must keep the two in order. NEMU executes guest loads and stores, MMIO
+// included, one by one in program order, so stopping the compiler from
+// reordering them is enough, and no fence instruction is needed.
+#define barrier() asm volatile ("" ::: "memory")
+
 #if defined(__ARCH_X86_NEMU)
 # define DEVICE_BASE 0x0
 #else
@@ -32,6 +38,9 @@
 #define VGACTL_ADDR     (DEVICE_BASE + 0x0000100)
 #define AUDIO_ADDR      (DEVICE_BASE + 0x0000200)
 #define DISK_ADDR       (DEVICE_BASE + 0x0000300)
+#define NET_ADDR        (DEVICE_BASE + 0x0000800)
+#define VIRTIO_BLK_ADDR     (MMIO_BASE + 0x0000400)
+#define VIRTIO_CONSOLE_ADDR (MMIO_BASE + 0x0000600)
 #define FB_ADDR         (MMIO_BASE   + 0x1000000)
 #define AUDIO_SBUF_ADDR (MMIO_BASE   + 0x1200000)
 
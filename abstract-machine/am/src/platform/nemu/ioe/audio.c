@@ -1,5 +1,6 @@
 #include <am.h>
 #include <nemu.h>
+#include <klib.h>
 
 #define AUDIO_FREQ_ADDR      (AUDIO_ADDR + 0x00)
 #define AUDIO_CHANNELS_ADDR  (AUDIO_ADDR + 0x04)
@@ -8,19 +9,49 @@
 #define AUDIO_INIT_ADDR      (AUDIO_ADDR + 0x10)
 #define AUDIO_COUNT_ADDR     (AUDIO_ADDR + 0x14)
 
+static int sbuf_size = 0;
+static int wpos = 0; // where the next sample is written in the stream buffer
+
 void __am_audio_init() {
+  sbuf_size = inl(AUDIO_SBUF_SIZE_ADDR);
 }
 
 void __am_audio_config(AM_AUDIO_CONFIG_T *cfg) {
-  cfg->present = false;
+  cfg->present = (sbuf_size != 0);
+  cfg->bufsize = sbuf_size;
 }
 
 void __am_audio_ctrl(AM_AUDIO_CTRL_T *ctrl) {
+  outl(AUDIO_FREQ_ADDR, ctrl->freq);
+  outl(AUDIO_CHANNELS_ADDR, ctrl->channels);
+  outl(AUDIO_SAMPLES_ADDR, ctrl->samples);
+  outl(AUDIO_INIT_ADDR, 1);
+  wpos = 0;
 }
 
 void __am_audio_status(AM_AUDIO_STATUS_T *stat) {
-  stat->count = 0;
+  stat->count = inl(AUDIO_COUNT_ADDR);
 }
 
 void __am_audio_play(AM_AUDIO_PLAY_T *ctl) {
+  uint8_t *sbuf = (uint8_t *)(uintptr_t)AUDIO_SBUF_ADDR;
+  uint8_t *p = ctl->buf.start;
+  int len = ctl->buf.end - ctl->buf.start;
+  while (len > 0) {
+    // wait for the device to drain enough of the stream buffer
+    int count, nwrite;
+    while ((count = inl(AUDIO_COUNT_ADDR)) == sbuf_size) ;
+    nwrite = sbuf_size - count;
+    if (nwrite > len) nwrite = len;
+    for (int i = 0; i < nwrite; ) {
+      int n = sbuf_size - wpos;
+      if (n > nwrite - i) n = nwrite - i;
+      memcpy(sbuf + wpos, p + i, n);
+      wpos = (wpos + n) % sbuf_size;
+      i += n;
+    }
+    outl(AUDIO_COUNT_ADDR, count + nwrite);
+    p += nwrite;
+    len -= nwrite;
+  }
 }
@@ -1,20 +1,57 @@
 #include <am.h>
 #include <nemu.h>
 
-#define SYNC_ADDR (VGACTL_ADDR + 4)
+#define SYNC_ADDR   (VGACTL_ADDR + 4)
+#define VMEMSZ_ADDR (VGACTL_ADDR + 8)
+#define CMD_ADDR    (VGACTL_ADDR + 12)
+#define ARG0_ADDR   (VGACTL_ADDR + 16)
+#define ARG1_ADDR   (VGACTL_ADDR + 20)
+#define ARG2_ADDR   (VGACTL_ADDR + 24)
+
+#define GPU_CMD_MEMCPY 1
+#define GPU_CMD_RENDER 2
+#define GPU_CMD_FILL   3
+#define GPU_CMD_BLIT   4
+
+static int W = 0, H = 0;
+static bool has_accel = false;
+
+static void gpu_cmd(uint32_t cmd, uint32_t arg0, uint32_t arg1, uint32_t arg2) {
+  outl(ARG0_ADDR, arg0);
+  outl(ARG1_ADDR, arg1);
+  outl(ARG2_ADDR, arg2);
+  outl(CMD_ADDR, cmd);
+}
 
 void __am_gpu_init() {
+  uint32_t size = inl(VGACTL_ADDR);
+  W = size >> 16;
+  H = size & 0xffff;
+  has_accel = inl(VMEMSZ_ADDR) != 0;
 }
 
 void __am_gpu_config(AM_GPU_CONFIG_T *cfg) {
   *cfg = (AM_GPU_CONFIG_T) {
-    .present = true, .has_accel = false,
-    .width = 0, .height = 0,
-    .vmemsz = 0
+    .present = true, .has_accel = has_accel,
+    .width = W, .height = H,
+    .vmemsz = inl(VMEMSZ_ADDR)
   };
 }
 
 void __am_gpu_fbdraw(AM_GPU_FBDRAW_T *ctl) {
+  int x = ctl->x, y = ctl->y, w = ctl->w, h = ctl->h;
+  if (w > 0 && h > 0 && ctl->pixels != NULL) {
+    if (has_accel) {
+      gpu_cmd(GPU_CMD_BLIT, (x << 16) | y, (w << 16) | h, (uintptr_t)ctl->pixels);
+    } else {
+      uint32_t *fb = (uint32_t *)(uintptr_t)FB_ADDR;
+      uint32_t *pixels = ctl->pixels;
+      int len = (x + w >= W) ? W - x : w;
+      for (int j = 0; j < h && y + j < H; j ++, pixels += w) {
+        for (int i = 0; i < len; i ++) fb[(y + j) * W + x + i] = pixels[i];
+      }
+    }
+  }
   if (ctl->sync) {
     outl(SYNC_ADDR, 1);
   }
@@ -23,3 +60,11 @@ void __am_gpu_fbdraw(AM_GPU_FBDRAW_T *ctl) {
 void __am_gpu_status(AM_GPU_STATUS_T *status) {
   status->ready = true;
 }
+
+void __am_gpu_memcpy(AM_GPU_MEMCPY_T *params) {
+  gpu_cmd(GPU_CMD_MEMCPY, params->dest, (uintptr_t)params->src, params->size);
+}
+
+void __am_gpu_render(AM_GPU_RENDER_T *ren) {
+  gpu_cmd(GPU_CMD_RENDER, ren->root, 0, 0);
+}
@@ -10,6 +10,8 @@ void __am_timer_uptime(AM_TIMER_UPTIME_T *);
 void __am_gpu_config(AM_GPU_CONFIG_T *);
 void __am_gpu_status(AM_GPU_STATUS_T *);
 void __am_gpu_fbdraw(AM_GPU_FBDRAW_T *);
+void __am_gpu_memcpy(AM_GPU_MEMCPY_T *);
+void __am_gpu_render(AM_GPU_RENDER_T *);
 void __am_audio_config(AM_AUDIO_CONFIG_T *);
 void __am_audio_ctrl(AM_AUDIO_CTRL_T *);
 void __am_audio_status(AM_AUDIO_STATUS_T *);
@@ -17,11 +19,22 @@ void __am_audio_play(AM_AUDIO_PLAY_T *);
 void __am_disk_config(AM_DISK_CONFIG_T *cfg);
 void __am_disk_status(AM_DISK_STATUS_T *stat);
 void __am_disk_blkio(AM_DISK_BLKIO_T *io);
+void __am_net_config(AM_NET_CONFIG_T *cfg);
+void __am_net_status(AM_NET_STATUS_T *stat);
+void __am_net_tx(AM_NET_TX_T *tx);
+void __am_net_rx(AM_NET_RX_T *rx);
+bool __am_virtio_blk_init();
+void __am_virtio_blk_config(AM_DISK_CONFIG_T *cfg);
+void __am_virtio_blk_status(AM_DISK_STATUS_T *stat);
+void __am_virtio_blk_blkio(AM_DISK_BLKIO_T *io);
+bool __am_virtio_console_init();
+void __am_virtio_uart_config(AM_UART_CONFIG_T *cfg);
+void __am_virtio_uart_tx(AM_UART_TX_T *tx);
+void __am_virtio_uart_rx(AM_UART_RX_T *rx);
 
 static void __am_timer_config(AM_TIMER_CONFIG_T *cfg) { cfg->present = true; cfg->has_rtc = true; }
 static void __am_input_config(AM_INPUT_CONFIG_T *cfg) { cfg->present = true;  }
 static void __am_uart_config(AM_UART_CONFIG_T *cfg)   { cfg->present = false; }
-static void __am_net_config (AM_NET_CONFIG_T *cfg)    { cfg->present = false; }
 
 typedef void (*handler_t)(void *buf);
 static void *lut[128] = {
@@ -33,6 +46,8 @@ static void *lut[128] = {
   [AM_GPU_CONFIG  ] = __am_gpu_config,
   [AM_GPU_FBDRAW  ] = __am_gpu_fbdraw,
   [AM_GPU_STATUS  ] = __am_gpu_status,
+  [AM_GPU_MEMCPY  ] = __am_gpu_memcpy,
+  [AM_GPU_RENDER  ] = __am_gpu_render,
   [AM_UART_CONFIG ] = __am_uart_config,
   [AM_AUDIO_CONFIG] = __am_audio_config,
   [AM_AUDIO_CTRL  ] = __am_audio_ctrl,
@@ -42,11 +57,27 @@ static void *lut[128] = {
   [AM_DISK_STATUS ] = __am_disk_status,
   [AM_DISK_BLKIO  ] = __am_disk_blkio,
   [AM_NET_CONFIG  ] = __am_net_config,
+  [AM_NET_STATUS  ] = __am_net_status,
+  [AM_NET_TX      ] = __am_net_tx,
+  [AM_NET_RX      ] = __am_net_rx,
 };
 
 static void fail(void *buf) { panic("access nonexist register"); }
 
 bool ioe_init() {
+#ifdef NEMU_VIRTIO
+  // NEMU is built with the virtio devices, which replace the disk and serial
+  if (__am_virtio_blk_init()) {
+    lut[AM_DISK_CONFIG] = __am_virtio_blk_config;
+    lut[AM_DISK_STATUS] = __am_virtio_blk_status;
+    lut[AM_DISK_BLKIO ] = __am_virtio_blk_blkio;
+  }
+  if (__am_virtio_console_init()) {
+    lut[AM_UART_CONFIG] = __am_virtio_uart_config;
+    lut[AM_UART_TX    ] = __am_virtio_uart_tx;
+    lut[AM_UART_RX    ] = __am_virtio_uart_rx;
+  }
+#endif
   for (int i = 0; i < LENGTH(lut); i++)
     if (!lut[i]) lut[i] = fail;
   __am_gpu_init();
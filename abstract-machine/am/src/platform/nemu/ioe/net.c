@@ -0,0 +1,73 @@
+#include <am.h>
+#include <nemu.h>
+#include <klib.h>
+
+#define NET_MTU_ADDR     (NET_ADDR + 0x00)
+#define NET_TX_RING_ADDR (NET_ADDR + 0x04)
+#define NET_TX_SIZE_ADDR (NET_ADDR + 0x08)
+#define NET_TX_HEAD_ADDR (NET_ADDR + 0x0c)
+#define NET_TX_TAIL_ADDR (NET_ADDR + 0x10)
+#define NET_RX_RING_ADDR (NET_ADDR + 0x14)
+#define NET_RX_SIZE_ADDR (NET_ADDR + 0x18)
+#define NET_RX_HEAD_ADDR (NET_ADDR + 0x1c)
+#define NET_RX_TAIL_ADDR (NET_ADDR + 0x20)
+
+#define NR_DESC 16
+#define RXBUF_SIZE 1536
+
+typedef struct {
+  uint32_t addr;
+  uint16_t len, flags;
+} NetDesc;
+
+static NetDesc tx_ring[NR_DESC], rx_ring[NR_DESC];
+static uint8_t rx_buf[NR_DESC][RXBUF_SIZE];
+static uint32_t tx_tail = 0, rx_next = 0, rx_tail = 0;
+static int mtu = -1;
+
+static void post_rxbuf(uint32_t idx) {
+  rx_ring[idx % NR_DESC] = (NetDesc) { (uintptr_t)rx_buf[idx % NR_DESC], RXBUF_SIZE, 0 };
+}
+
+// the rings are set up at the first NET_CONFIG, so that programs without
+// networking do not touch the network card
+void __am_net_config(AM_NET_CONFIG_T *cfg) {
+  if (mtu == -1) {
+    mtu = inl(NET_MTU_ADDR);
+    outl(NET_TX_RING_ADDR, (uintptr_t)tx_ring);
+    outl(NET_TX_SIZE_ADDR, NR_DESC);
+    outl(NET_RX_RING_ADDR, (uintptr_t)rx_ring);
+    outl(NET_RX_SIZE_ADDR, NR_DESC);
+    for (rx_tail = 0; rx_tail < NR_DESC; rx_tail ++) post_rxbuf(rx_tail);
+    barrier();
+    outl(NET_RX_TAIL_ADDR, rx_tail);
+  }
+  cfg->present = (mtu > 0);
+}
+
+void __am_net_status(AM_NET_STATUS_T *stat) {
+  stat->rx_len = (rx_next != inl(NET_RX_HEAD_ADDR) ? rx_ring[rx_next % NR_DESC].len : 0);
+  stat->tx_len = (tx_tail - inl(NET_TX_HEAD_ADDR) < NR_DESC ? mtu : 0);
+}
+
+void __am_net_tx(AM_NET_TX_T *tx) {
+  int len = tx->buf.end - tx->buf.start;
+  panic_on(len > mtu, "frame larger than MTU");
+  while (tx_tail - inl(NET_TX_HEAD_ADDR) == NR_DESC) ;
+  // NEMU copies the frame when the tail is written, so it is sent from the buffer of the caller
+  tx_ring[tx_tail % NR_DESC] = (NetDesc) { (uintptr_t)tx->buf.start, len, 0 };
+  barrier();
+  outl(NET_TX_TAIL_ADDR, ++ tx_tail);
+}
+
+// receive the next frame to `buf`, which should be as large as the rx_len of NET_STATUS
+void __am_net_rx(AM_NET_RX_T *rx) {
+  if (rx_next == inl(NET_RX_HEAD_ADDR)) return;
+  NetDesc *d = &rx_ring[rx_next % NR_DESC];
+  int len = rx->buf.end - rx->buf.start;
+  memcpy(rx->buf.start, rx_buf[rx_next % NR_DESC], (d->len < len ? d->len : len));
+  rx_next ++;
+  post_rxbuf(rx_tail);
+  barrier();
+  outl(NET_RX_TAIL_ADDR, ++ rx_tail);
+}
@@ -0,0 +1,201 @@
+#include <am.h>
+#include <nemu.h>
+#include <klib.h>
+
+// Drivers of the virtio-mmio block device and console of NEMU, enabled by
+// building with NEMU_VIRTIO=1. Requests are put in the split virtqueues below
+// and submitted with one write to QueueNotify. NEMU serves them during that
+// write, so the used ring is polled right after it.
+
+#define MAGIC_VALUE     0x000
+#define VERSION         0x004
+#define DEVICE_ID       0x008
+#define DEVICE_FEATURES 0x010
+#define DEVICE_FEATURES_SEL 0x014
+#define DRIVER_FEATURES 0x020
+#define DRIVER_FEATURES_SEL 0x024
+#define QUEUE_SEL       0x030
+#define QUEUE_NUM_MAX   0x034
+#define QUEUE_NUM       0x038
+#define QUEUE_READY     0x044
+#define QUEUE_NOTIFY    0x050
+#define STATUS          0x070
+#define QUEUE_DESC      0x080
+#define QUEUE_DRIVER    0x090
+#define QUEUE_DEVICE    0x0a0
+#define CONFIG          0x100
+
+#define STATUS_ACKNOWLEDGE 1
+#define STATUS_DRIVER      2
+#define STATUS_DRIVER_OK   4
+#define STATUS_FEATURES_OK 8
+
+#define DESC_F_NEXT  1
+#define DESC_F_WRITE 2
+
+#define QSIZE 8
+
+struct virtq_desc {
+  uint64_t addr;
+  uint32_t len;
+  uint16_t flags, next;
+};
+
+struct virtq {
+  struct virtq_desc desc[QSIZE];
+  struct {
+    uint16_t flags, idx, ring[QSIZE], used_event;
+  } avail;
+  struct {
+    uint16_t flags, idx;
+    struct { uint32_t id, len; } ring[QSIZE];
+    uint16_t avail_event;
+  } used __attribute__((aligned(4)));
+  uint16_t last_used;
+} __attribute__((aligned(16)));
+
+static inline uint32_t vread(uintptr_t base, int reg) { return *(volatile uint32_t *)(base + reg); }
+static inline void vwrite(uintptr_t base, int reg, uint32_t data) { *(volatile uint32_t *)(base + reg) = data; }
+
+static void setup_queue(uintptr_t base, int q, struct virtq *vq) {
+  vwrite(base, QUEUE_SEL, q);
+  panic_on(vread(base, QUEUE_NUM_MAX) < QSIZE, "virtqueue too small");
+  vwrite(base, QUEUE_NUM, QSIZE);
+  vwrite(base, QUEUE_DESC, (uintptr_t)vq->desc);
+  vwrite(base, QUEUE_DESC + 4, 0);
+  vwrite(base, QUEUE_DRIVER, (uintptr_t)&vq->avail);
+  vwrite(base, QUEUE_DRIVER + 4, 0);
+  vwrite(base, QUEUE_DEVICE, (uintptr_t)&vq->used);
+  vwrite(base, QUEUE_DEVICE + 4, 0);
+  vwrite(base, QUEUE_READY, 1);
+}
+
+static bool setup_device(uintptr_t base, uint32_t id, struct virtq *vq, int nr_queue) {
+  if (vread(base, MAGIC_VALUE) != 0x74726976 || vread(base, VERSION) != 2 ||
+      vread(base, DEVICE_ID) != id) return false;
+  vwrite(base, STATUS, 0);
+  vwrite(base, STATUS, STATUS_ACKNOWLEDGE | STATUS_DRIVER);
+  // only VIRTIO_F_VERSION_1 (bit 32) is used
+  vwrite(base, DRIVER_FEATURES_SEL, 0);
+  vwrite(base, DRIVER_FEATURES, 0);
+  vwrite(base, DRIVER_FEATURES_SEL, 1);
+  vwrite(base, DRIVER_FEATURES, 1);
+  vwrite(base, STATUS, STATUS_ACKNOWLEDGE | STATUS_DRIVER | STATUS_FEATURES_OK);
+  for (int i = 0; i < nr_queue; i ++) setup_queue(base, i, &vq[i]);
+  vwrite(base, STATUS, STATUS_ACKNOWLEDGE | STATUS_DRIVER | STATUS_FEATURES_OK | STATUS_DRIVER_OK);
+  return true;
+}
+
+static void submit(uintptr_t base, int q, struct virtq *vq, uint16_t head) {
+  vq->avail.ring[vq->avail.idx % QSIZE] = head;
+  barrier();
+  vq->avail.idx ++;
+  barrier();
+  vwrite(base, QUEUE_NOTIFY, q);
+}
+
+// wait for the next used buffer, and return its index in the used ring
+static int wait_used(struct virtq *vq) {
+  while (*(volatile uint16_t *)&vq->used.idx == vq->last_used) ;
+  return vq->last_used ++ % QSIZE;
+}
+
+// block device
+// ====================================================
+
+static struct virtq blkq;
+static bool blk_present = false;
+
+bool __am_virtio_blk_init() {
+  blk_present = setup_device(VIRTIO_BLK_ADDR, 2, &blkq, 1);
+  return blk_present;
+}
+
+void __am_virtio_blk_config(AM_DISK_CONFIG_T *cfg) {
+  cfg->present = blk_present;
+  cfg->blksz = 512;
+  cfg->blkcnt = vread(VIRTIO_BLK_ADDR, CONFIG); // the low 32 bits of the capacity
+}
+
+void __am_virtio_blk_status(AM_DISK_STATUS_T *stat) {
+  stat->ready = true;
+}
+
+void __am_virtio_blk_blkio(AM_DISK_BLKIO_T *io) {
+  static struct { uint32_t type, reserved; uint64_t sector; } req;
+  static volatile uint8_t status;
+  req.type = (io->write ? 1 : 0);
+  req.reserved = 0;
+  req.sector = io->blkno;
+  status = 0xff;
+  blkq.desc[0] = (struct virtq_desc) { (uintptr_t)&req, sizeof(req), DESC_F_NEXT, 1 };
+  blkq.desc[1] = (struct virtq_desc) { (uintptr_t)io->buf, io->blkcnt * 512,
+    DESC_F_NEXT | (io->write ? 0 : DESC_F_WRITE), 2 };
+  blkq.desc[2] = (struct virtq_desc) { (uintptr_t)&status, 1, DESC_F_WRITE, 0 };
+  submit(VIRTIO_BLK_ADDR, 0, &blkq, 0);
+  wait_used(&blkq);
+  panic_on(status != 0, "virtio-blk request failed");
+}
+
+// console
+// ====================================================
+
+#define RECEIVEQ  0
+#define TRANSMITQ 1
+#define RXBUF_LEN 64
+
+static struct virtq conq[2];
+static bool console_present = false;
+static char rxbuf[QSIZE][RXBUF_LEN];
+static int rx_cur = -1, rx_pos = 0, rx_len = 0;
+static char txbuf[128];
+static int nr_tx = 0;
+
+static void post_rxbuf(int i) {
+  conq[RECEIVEQ].desc[i] = (struct virtq_desc) { (uintptr_t)rxbuf[i], RXBUF_LEN, DESC_F_WRITE, 0 };
+  submit(VIRTIO_CONSOLE_ADDR, RECEIVEQ, &conq[RECEIVEQ], i);
+}
+
+static void console_flush() {
+  if (nr_tx == 0) return;
+  conq[TRANSMITQ].desc[0] = (struct virtq_desc) { (uintptr_t)txbuf, nr_tx, 0, 0 };
+  submit(VIRTIO_CONSOLE_ADDR, TRANSMITQ, &conq[TRANSMITQ], 0);
+  wait_used(&conq[TRANSMITQ]);
+  nr_tx = 0;
+}
+
+bool __am_virtio_console_init() {
+  console_present = setup_device(VIRTIO_CONSOLE_ADDR, 3, conq, 2);
+  if (console_present) {
+    for (int i = 0; i < QSIZE; i ++) post_rxbuf(i);
+  }
+  return console_present;
+}
+
+void __am_virtio_uart_config(AM_UART_CONFIG_T *cfg) {
+  cfg->present = console_present;
+}
+
+// output is sent a line at a time, or when the buffer is full
+void __am_virtio_uart_tx(AM_UART_TX_T *tx) {
+  txbuf[nr_tx ++] = tx->data;
+  if (tx->data == '\n' || nr_tx == sizeof(txbuf)) console_flush();
+}
+
+void __am_virtio_uart_rx(AM_UART_RX_T *rx) {
+  console_flush(); // show the prompt before waiting for input
+  if (rx_cur >= 0 && rx_pos == rx_len) {
+    post_rxbuf(rx_cur);
+    rx_cur = -1;
+  }
+  if (rx_cur < 0) {
+    struct virtq *vq = &conq[RECEIVEQ];
+    if (*(volatile uint16_t *)&vq->used.idx == vq->last_used) { rx->data = -1; return; }
+    int i = wait_used(vq);
+    rx_cur = vq->used.ring[i].id;
+    rx_len = vq->used.ring[i].len;
+    rx_pos = 0;
+    if (rx_len == 0) { rx->data = -1; return; }
+  }
+  rx->data = rxbuf[rx_cur][rx_pos ++];
+}
@@ -20,6 +20,14 @@
 
 void cpu_exec(uint64_t n);
 
+#ifdef CONFIG_ENGINE_BLOCK
+struct Decode;
+extern bool g_block_flushed;
+uint64_t block_exec(struct Decode *s, uint64_t n);
+void block_flush();
+void block_invalidate(vaddr_t addr, int len);
+#endif
+
 void set_nemu_state(int state, vaddr_t pc, int halt_ret);
 void invalid_inst(vaddr_t thispc);
 
@@ -87,6 +87,17 @@ finish:
 
 
 // --- pattern matching wrappers for decode ---
+#ifdef INSTPAT_TREE
+// The decision tree generated by tools/instpat-tree is placed at the first
+// INSTPAT of each table. It jumps to the matched INSTPAT directly.
+#define INSTPAT(pattern, ...) \
+  concat(INSTPAT_DISPATCH_, __LINE__) \
+  concat(__instpat_, __LINE__): __attribute__((unused)); \
+  { \
+    INSTPAT_MATCH(s, ##__VA_ARGS__); \
+    goto *(__instpat_end); \
+  }
+#else
 #define INSTPAT(pattern, ...) do { \
   uint64_t key, mask, shift; \
   pattern_decode(pattern, STRLEN(pattern), &key, &mask, &shift); \
@@ -95,6 +106,7 @@ finish:
     goto *(__instpat_end); \
   } \
 } while (0)
+#endif
 
 #define INSTPAT_START(name) { const void * __instpat_end = &&concat(__instpat_end_, name);
 #define INSTPAT_END(name)   concat(__instpat_end_, name): ; }
@@ -0,0 +1,35 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __CPU_EVENT_H__
+#define __CPU_EVENT_H__
+
+#include <common.h>
+
+typedef void (*event_handler_t)();
+
+// the value of g_nr_guest_inst when the earliest event is due
+extern uint64_t g_event_deadline;
+
+/* call `handler` after the guest executes `delay` more instructions */
+void event_add(event_handler_t handler, uint64_t delay);
+/* call the handlers of all events which are due */
+void event_run();
+/* the guest waits for something to happen, skip to the next event */
+void event_idle();
+/* move all events by `delta` instructions, e.g. after restoring g_nr_guest_inst */
+void event_shift(int64_t delta);
+
+#endif
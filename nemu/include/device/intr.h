@@ -0,0 +1,36 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __DEVICE_INTR_H__
+#define __DEVICE_INTR_H__
+
+#include <common.h>
+
+#define IRQ_TIMER 0
+#define IRQ_VIRTIO_BLK 1
+#define IRQ_VIRTIO_CONSOLE 2
+#define IRQ_NET 3
+
+// Devices raise interrupts by setting bits in an atomic bitmap, which is
+// safe from any host thread. The CPU loop checks the bitmap at the next block
+// boundary, and asks isa_query_intr() whether the guest takes an interrupt.
+
+/* mark `irq` pending and make the CPU loop check it */
+void dev_raise_intr(int irq);
+void dev_clear_intr(int irq);
+/* the bitmap of pending interrupts */
+uint32_t dev_intr_pending();
+
+#endif
@@ -34,15 +34,26 @@ static inline bool map_inside(IOMap *map, paddr_t addr) {
   return (addr >= map->low && addr <= map->high);
 }
 
-static inline int find_mapid_by_addr(IOMap *maps, int size, paddr_t addr) {
-  int i;
-  for (i = 0; i < size; i ++) {
-    if (map_inside(maps + i, addr)) {
-      difftest_skip_ref();
-      return i;
-    }
+// A growable list of maps sorted by address. Maps are allocated separately,
+// so pointers to them stay valid when more maps are added.
+typedef struct {
+  IOMap **map;
+  int nr, max;
+} IOMapList;
+
+IOMap* map_list_add(IOMapList *list, const char *name, paddr_t addr,
+        void *space, uint32_t len, io_callback_t callback);
+
+static inline IOMap* map_list_find(IOMapList *list, paddr_t addr) {
+  int l = 0, r = list->nr - 1;
+  while (l <= r) {
+    int mid = (l + r) / 2;
+    IOMap *map = list->map[mid];
+    if (addr < map->low) r = mid - 1;
+    else if (addr > map->high) l = mid + 1;
+    else return map;
   }
-  return -1;
+  return NULL;
 }
 
 void add_pio_map(const char *name, ioaddr_t addr,
@@ -50,6 +61,12 @@ void add_pio_map(const char *name, ioaddr_t addr,
 void add_mmio_map(const char *name, paddr_t addr,
         void *space, uint32_t len, io_callback_t callback);
 
+/* route accesses to the physical pages of `map` through the page table */
+void paddr_add_map(IOMap *map);
+
+/* the number of accesses through map_read() and map_write() */
+extern uint64_t g_nr_map_access;
+
 word_t map_read(paddr_t addr, int len, IOMap *map);
 void map_write(paddr_t addr, int len, word_t data, IOMap *map);
 
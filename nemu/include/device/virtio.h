@@ -0,0 +1,80 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __DEVICE_VIRTIO_H__
+#define __DEVICE_VIRTIO_H__
+
+#include <common.h>
+
+// virtio-mmio transport (version 2) with split virtqueues, see
+// https://docs.oasis-open.org/virtio/virtio/v1.1/virtio-v1.1.html
+
+#define VIRTIO_ID_BLOCK   2
+#define VIRTIO_ID_CONSOLE 3
+
+#define VIRTIO_F_VERSION_1 (1ull << 32)
+
+#define VIRTIO_NR_QUEUE  2
+#define VIRTIO_QUEUE_MAX 256
+#define VIRTIO_MAX_SEG   64
+#define VIRTIO_MMIO_SIZE 0x200
+#define VIRTIO_CONFIG    0x100 // offset of the device-specific configuration
+
+typedef struct {
+  uint32_t num, ready;
+  uint64_t desc, avail, used;
+  uint16_t last_avail; // the next entry of the available ring to process
+} VirtQueue;
+
+// a descriptor chain taken from the available ring, with host pointers
+typedef struct {
+  uint16_t head;
+  int nr_seg;
+  struct {
+    uint8_t *buf;
+    uint32_t len;
+    bool write; // written by the device
+  } seg[VIRTIO_MAX_SEG];
+} VirtChain;
+
+typedef struct VirtioDev {
+  const char *name;
+  uint32_t device_id;
+  uint64_t features;
+  int nr_queue;
+  int irq;
+  // called on a write to QueueNotify
+  void (*notify)(struct VirtioDev *dev, int q);
+
+  uint32_t *regs; // the MMIO space, whose configuration is at VIRTIO_CONFIG
+  // the state below is saved in checkpoints
+  uint32_t status, intr_status;
+  uint32_t features_sel, driver_features_sel, queue_sel;
+  uint64_t driver_features;
+  VirtQueue queue[VIRTIO_NR_QUEUE];
+} VirtioDev;
+
+/* map the registers of `dev` at `addr` with the access handler `handler`,
+ * which should call virtio_mmio_access() with `dev` */
+void virtio_init(VirtioDev *dev, paddr_t addr, void (*handler)(uint32_t, int, bool));
+void virtio_mmio_access(VirtioDev *dev, uint32_t offset, int len, bool is_write);
+
+/* take the next chain from the available ring of queue `q` */
+bool virtq_pop(VirtioDev *dev, int q, VirtChain *c);
+/* return the chain to the driver with `len` bytes written by the device,
+ * and raise the interrupt of the device */
+void virtq_push(VirtioDev *dev, int q, VirtChain *c, uint32_t len);
+
+#endif
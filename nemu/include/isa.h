@@ -36,6 +36,18 @@ word_t isa_reg_str2val(const char *name, bool *success);
 // exec
 struct Decode;
 int isa_exec_once(struct Decode *s);
+#ifdef CONFIG_DECODE_OP
+typedef concat(__GUEST_ISA__, _DecodeOp) DecodeOp;
+#endif
+#ifdef CONFIG_ENGINE_BLOCK
+int isa_exec_record(struct Decode *s, DecodeOp *op);
+int isa_exec_ops(struct Decode *s, DecodeOp *op, int nr_op);
+#endif
+#ifdef CONFIG_DECODE_CACHE
+extern uint64_t g_dcache_hit, g_dcache_miss;
+void isa_dcache_flush();
+void isa_dcache_invalidate(vaddr_t addr, int len);
+#endif
 
 // memory
 enum { MMU_DIRECT, MMU_TRANSLATE, MMU_FAIL };
@@ -45,6 +57,9 @@ enum { MEM_RET_OK, MEM_RET_FAIL, MEM_RET_CROSS_PAGE };
 int isa_mmu_check(vaddr_t vaddr, int len, int type);
 #endif
 paddr_t isa_mmu_translate(vaddr_t vaddr, int len, int type);
+#ifndef isa_mmu_ctx
+#define isa_mmu_ctx() 0
+#endif
 
 // interrupt/exception
 vaddr_t isa_raise_intr(word_t NO, vaddr_t epc);
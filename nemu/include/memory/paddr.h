@@ -31,6 +31,31 @@ static inline bool in_pmem(paddr_t addr) {
   return addr - CONFIG_MBASE < CONFIG_MSIZE;
 }
 
+/* whether [addr, addr + len) is in pmem; devices check their DMA buffers with
+ * this, which is computed in 64 bits so that a large len can not wrap around */
+static inline bool in_pmem_range(uint64_t addr, uint64_t len) {
+  return len <= CONFIG_MSIZE && addr - CONFIG_MBASE <= CONFIG_MSIZE - len;
+}
+
+/* Make [addr, addr + len) of pmem accessible before the host kernel accesses
+ * it, e.g. by read() or send(), which fail on memory not touched yet. */
+void pmem_prefault(paddr_t addr, uint64_t len);
+
+/* whether the guest may have touched `addr` in pmem; an untouched address
+ * still holds its initial value */
+bool pmem_touched(paddr_t addr);
+
+/* make all of pmem untouched again, so that it holds its initial value
+ * until the next touch */
+void pmem_untouch_all();
+
+/* called by devices after writing [addr, addr + len) of pmem directly, so that
+ * the decoded instructions and the blocks there are thrown away */
+void paddr_dma_write(paddr_t addr, uint64_t len);
+
+/* return the host address of a RAM-like physical address, or NULL */
+uint8_t* paddr_host(paddr_t addr);
+
 word_t paddr_read(paddr_t addr, int len);
 void paddr_write(paddr_t addr, int len, word_t data);
 
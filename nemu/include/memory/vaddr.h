@@ -21,6 +21,11 @@
 word_t vaddr_ifetch(vaddr_t addr, int len);
 word_t vaddr_read(vaddr_t addr, int len);
 void vaddr_write(vaddr_t addr, int len, word_t data);
+void tlb_flush();
+
+#ifdef CONFIG_TLB
+extern uint64_t g_tlb_hit[3], g_tlb_miss[3];
+#endif
 
 #define PAGE_SHIFT        12
 #define PAGE_SIZE         (1ul << PAGE_SHIFT)
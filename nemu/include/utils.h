@@ -34,6 +34,30 @@ extern NEMUState nemu_state;
 
 uint64_t get_time();
 
+// With --icount=N, each guest instruction takes 2^N ns of guest time, so that
+// guest time is deterministic. It is -1 if guest time follows the host time.
+extern int g_icount_shift;
+// guest instructions skipped by idling with --icount, which count as guest time
+extern uint64_t g_icount_bias;
+/* the time seen by the guest, in us */
+uint64_t get_guest_time();
+/* the number of guest instructions in `us` of guest time with --icount */
+uint64_t icount_from_us(uint64_t us);
+
+// ----------- checkpoint -----------
+
+typedef void (*checkpoint_hook_t)();
+
+#ifdef CONFIG_CHECKPOINT
+/* save [addr, addr + size) in checkpoints, and call `after_load` (if not NULL)
+ * after it is restored; registering `name` again replaces the old region */
+void checkpoint_add(const char *name, void *addr, size_t size, checkpoint_hook_t after_load);
+bool checkpoint_save(const char *file);
+bool checkpoint_load(const char *file);
+#else
+static inline void checkpoint_add(const char *name, void *addr, size_t size, checkpoint_hook_t after_load) {}
+#endif
+
 // ----------- log -----------
 
 #define ANSI_FG_BLACK   "\33[1;30m"
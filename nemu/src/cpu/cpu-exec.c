@@ -15,6 +15,9 @@
 #include <cpu/cpu.h>
 #include <cpu/decode.h>
 #include <cpu/difftest.h>
+#include <cpu/event.h>
+#include <device/intr.h>
+#include <memory/vaddr.h>
 #include <locale.h>
 
 
@@ -30,17 +33,46 @@ uint64_t g_nr_guest_inst = 0;
 static uint64_t g_timer = 0; // unit: us
 static bool g_print_step = false;
 
-void device_update();
 void check_watchpoints();
+void net_statistic(uint64_t host_us);
+void serial_flush();
+bool has_watchpoint();
 static void trace_and_difftest(Decode *_this, vaddr_t dnpc) {
 #ifdef CONFIG_ITRACE_COND
   if (ITRACE_COND) { log_write("%s\n", _this->logbuf); }
 #endif
   if (g_print_step) { IFDEF(CONFIG_ITRACE, puts(_this->logbuf)); }
   IFDEF(CONFIG_DIFFTEST, difftest_step(_this->pc, dnpc));
-  check_watchpoints();
+  IFDEF(CONFIG_WATCHPOINT, check_watchpoints());
 }
 
+/* Run the events which are due, and take a pending interrupt if the guest
+ * accepts it. Interrupts are only delivered here, between blocks.
+ */
+static void run_events() {
+  event_run();
+#ifdef CONFIG_DEVICE
+  if (dev_intr_pending()) {
+    word_t intr = isa_query_intr();
+    if (intr != INTR_EMPTY) cpu.pc = isa_raise_intr(intr, cpu.pc);
+  }
+#endif
+}
+
+#ifdef CONFIG_ENGINE_BLOCK
+static void execute_traced(uint64_t n) {
+  Decode s;
+  while (n > 0) {
+    uint64_t nr = block_exec(&s, n);
+    cpu.pc = s.dnpc;
+    g_nr_guest_inst += nr;
+    n -= nr;
+    trace_and_difftest(&s, cpu.pc);
+    if (nemu_state.state != NEMU_RUNNING) break;
+    if (g_nr_guest_inst >= g_event_deadline) run_events();
+  }
+}
+#else
 static void exec_once(Decode *s, vaddr_t pc) {
   s->pc = pc;
   s->snpc = pc;
@@ -72,15 +104,87 @@ static void exec_once(Decode *s, vaddr_t pc) {
 #endif
 }
 
-
-static void execute(uint64_t n) {
+static void execute_traced(uint64_t n) {
   Decode s;
   for (;n > 0; n --) {
     exec_once(&s, cpu.pc);
     g_nr_guest_inst ++;
     trace_and_difftest(&s, cpu.pc);
     if (nemu_state.state != NEMU_RUNNING) break;
-    IFDEF(CONFIG_DEVICE, device_update());
+    if (g_nr_guest_inst >= g_event_deadline) run_events();
+  }
+}
+#endif // CONFIG_ENGINE_BLOCK
+
+/* Execute `n` instructions without tracing, difftest and watchpoints.
+ * Execution only stops for the next event, instead of checking for it after
+ * every instruction.
+ */
+static void execute_fast(uint64_t n) {
+  Decode s;
+  uint64_t end = g_nr_guest_inst + n;
+  while (g_nr_guest_inst < end) {
+    // the deadline may be moved by an instruction, e.g. when the guest idles
+    if (g_nr_guest_inst >= g_event_deadline) {
+      run_events();
+      if (nemu_state.state != NEMU_RUNNING) return;
+    }
+#ifdef CONFIG_ENGINE_BLOCK
+    uint64_t stop = (g_event_deadline < end ? g_event_deadline : end);
+    g_nr_guest_inst += block_exec(&s, stop - g_nr_guest_inst);
+#else
+    s.pc = cpu.pc;
+    s.snpc = cpu.pc;
+    isa_exec_once(&s);
+    g_nr_guest_inst ++;
+#endif
+    cpu.pc = s.dnpc;
+    if (nemu_state.state != NEMU_RUNNING) return;
+  }
+}
+
+/* Return the number of instructions which can be executed by the fast loop
+ * before something should be checked after every instruction.
+ */
+static uint64_t fast_budget(uint64_t n) {
+  IFDEF(CONFIG_DIFFTEST, return 0);
+  IFDEF(CONFIG_WATCHPOINT, if (has_watchpoint()) return 0);
+#ifdef CONFIG_ITRACE
+  if (g_print_step) return 0;
+  if (g_nr_guest_inst <= CONFIG_TRACE_END) {
+    // stop before the trace window begins
+    if (g_nr_guest_inst >= CONFIG_TRACE_START) return 0;
+    if (n > CONFIG_TRACE_START - g_nr_guest_inst) n = CONFIG_TRACE_START - g_nr_guest_inst;
+  }
+#endif
+  // avoid overflow of the instruction counter when n = -1
+  if (n > UINT64_MAX - g_nr_guest_inst) n = UINT64_MAX - g_nr_guest_inst;
+  return n;
+}
+
+/* Return the number of instructions which should be executed by the traced
+ * loop. Only the trace window is traced, and the fast loop takes over again
+ * after it ends.
+ */
+static uint64_t traced_budget(uint64_t n) {
+  IFDEF(CONFIG_DIFFTEST, return n);
+  IFDEF(CONFIG_WATCHPOINT, if (has_watchpoint()) return n);
+#ifdef CONFIG_ITRACE
+  if (!g_print_step && g_nr_guest_inst <= CONFIG_TRACE_END &&
+      n > CONFIG_TRACE_END + 1 - g_nr_guest_inst) {
+    n = CONFIG_TRACE_END + 1 - g_nr_guest_inst;
+  }
+#endif
+  return n;
+}
+
+static void execute(uint64_t n) {
+  while (n > 0 && nemu_state.state == NEMU_RUNNING) {
+    uint64_t start = g_nr_guest_inst;
+    uint64_t nr_fast = fast_budget(n);
+    if (nr_fast > 0) execute_fast(nr_fast);
+    else execute_traced(traced_budget(n));
+    n -= g_nr_guest_inst - start;
   }
 }
 
@@ -91,9 +195,22 @@ static void statistic() {
   Log("total guest instructions = " NUMBERIC_FMT, g_nr_guest_inst);
   if (g_timer > 0) Log("simulation frequency = " NUMBERIC_FMT " inst/s", g_nr_guest_inst * 1000000 / g_timer);
   else Log("Finish running in less than 1 us and can not calculate the simulation frequency");
+  IFDEF(CONFIG_DECODE_CACHE, Log("decode cache hit = " NUMBERIC_FMT ", miss = " NUMBERIC_FMT,
+        g_dcache_hit, g_dcache_miss));
+  IFDEF(CONFIG_HAS_NET, net_statistic(g_timer));
+#ifdef CONFIG_TLB
+  const char *tlb_name[] = { "ifetch", "read", "write" };
+  int i;
+  for (i = 0; i < 3; i ++) {
+    uint64_t total = g_tlb_hit[i] + g_tlb_miss[i];
+    if (total > 0) Log("%s TLB hit = " NUMBERIC_FMT ", miss = " NUMBERIC_FMT ", hit rate = %.2f%%",
+        tlb_name[i], g_tlb_hit[i], g_tlb_miss[i], g_tlb_hit[i] * 100.0 / total);
+  }
+#endif
 }
 
 void assert_fail_msg() {
+  IFDEF(CONFIG_HAS_SERIAL, serial_flush());
   isa_reg_display();
   statistic();
 }
@@ -114,6 +231,8 @@ void cpu_exec(uint64_t n) {
 
   uint64_t timer_end = get_time();
   g_timer += timer_end - timer_start;
+  // show a partial line of the guest before returning to sdb
+  IFDEF(CONFIG_HAS_SERIAL, serial_flush());
 
   switch (nemu_state.state) {
     case NEMU_RUNNING: nemu_state.state = NEMU_STOP; break;
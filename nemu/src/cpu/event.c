@@ -0,0 +1,99 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <cpu/event.h>
+#include <utils.h>
+#ifndef CONFIG_TARGET_AM
+#include <unistd.h>
+#endif
+
+// how long the host sleeps when the guest idles without --icount
+#define IDLE_SLEEP_US 1000
+
+// Events are kept in a binary min-heap ordered by their deadlines, so the CPU
+// loop only compares g_nr_guest_inst with g_event_deadline.
+#define NR_EVENT 32
+
+typedef struct {
+  uint64_t when;
+  event_handler_t handler;
+} Event;
+
+static Event heap[NR_EVENT] = {};
+static int nr_event = 0;
+uint64_t g_event_deadline = UINT64_MAX;
+
+extern uint64_t g_nr_guest_inst;
+
+static void update_deadline() {
+  g_event_deadline = (nr_event > 0 ? heap[0].when : UINT64_MAX);
+}
+
+void event_add(event_handler_t handler, uint64_t delay) {
+  Assert(nr_event < NR_EVENT, "too many pending events");
+  uint64_t when = g_nr_guest_inst + delay;
+  if (when < g_nr_guest_inst) when = UINT64_MAX; // never
+  int i = nr_event ++;
+  for (; i > 0 && heap[(i - 1) / 2].when > when; i = (i - 1) / 2) heap[i] = heap[(i - 1) / 2];
+  heap[i] = (Event){ .when = when, .handler = handler };
+  update_deadline();
+}
+
+static Event event_pop() {
+  Event top = heap[0], last = heap[-- nr_event];
+  int i = 0;
+  while (2 * i + 1 < nr_event) {
+    int c = 2 * i + 1;
+    if (c + 1 < nr_event && heap[c + 1].when < heap[c].when) c ++;
+    if (last.when <= heap[c].when) break;
+    heap[i] = heap[c];
+    i = c;
+  }
+  heap[i] = last;
+  return top;
+}
+
+void event_run() {
+  while (nr_event > 0 && heap[0].when <= g_nr_guest_inst) {
+    Event e = event_pop();
+    update_deadline();
+    e.handler(); // may add new events
+  }
+  update_deadline();
+}
+
+void event_shift(int64_t delta) {
+  int i;
+  // shifting all deadlines by the same amount keeps the heap order
+  for (i = 0; i < nr_event; i ++) {
+    if (heap[i].when == UINT64_MAX) continue;
+    if (delta < 0 && heap[i].when < (uint64_t)-delta) heap[i].when = 0;
+    else heap[i].when += delta;
+  }
+  update_deadline();
+}
+
+void event_idle() {
+  if (g_icount_shift < 0) {
+    // the next event depends on the host time, just give the host CPU away
+    IFNDEF(CONFIG_TARGET_AM, usleep(IDLE_SLEEP_US));
+    return;
+  }
+  if (g_event_deadline == UINT64_MAX || g_event_deadline <= g_nr_guest_inst) return;
+  // the skipped instructions still count as guest time
+  uint64_t n = g_event_deadline - g_nr_guest_inst;
+  g_icount_bias += n;
+  event_shift(-(int64_t)n);
+}
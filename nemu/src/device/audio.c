@@ -30,7 +30,86 @@ enum {
 static uint8_t *sbuf = NULL;
 static uint32_t *audio_base = NULL;
 
+// The stream buffer is a single-producer/single-consumer ring. The guest
+// appends samples at `head` and the SDL callback drains them at `tail` on the
+// audio thread. Both are running byte counts, so `head - tail` is the number
+// of queued bytes and each side only writes its own index, without a lock.
+static uint64_t head = 0, tail = 0;
+static uint32_t last_count = 0; // the count last seen by the guest
+static uint64_t underrun = 0;
+static bool opened = false;
+
+static void audio_play(void *userdata, uint8_t *stream, int len) {
+  uint64_t t = tail;
+  uint64_t h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+  int nread = (h - t < len ? h - t : len);
+  for (int i = 0; i < nread; ) {
+    int off = (t + i) % CONFIG_SB_SIZE;
+    int n = (CONFIG_SB_SIZE - off < nread - i ? CONFIG_SB_SIZE - off : nread - i);
+    memcpy(stream + i, sbuf + off, n);
+    i += n;
+  }
+  __atomic_store_n(&tail, t + nread, __ATOMIC_RELEASE);
+  if (nread < len) {
+    memset(stream + nread, 0, len - nread);
+    // do not report the silence before the guest starts to play
+    if (h != 0) {
+      underrun ++;
+      if ((underrun & (underrun - 1)) == 0) Log("audio underrun (%" PRIu64 " times)", underrun);
+    }
+  }
+}
+
+static void audio_init() {
+  SDL_AudioSpec s = {};
+  s.format = AUDIO_S16SYS;
+  s.userdata = NULL;
+  s.freq = audio_base[reg_freq];
+  s.channels = audio_base[reg_channels];
+  s.samples = audio_base[reg_samples];
+  s.callback = audio_play;
+  // a reconfiguration closes the device first, which also waits for the
+  // callback, so that the ring is not reset under it
+  if (opened) {
+    SDL_CloseAudio();
+    opened = false;
+  }
+  head = tail = 0;
+  last_count = 0;
+  SDL_InitSubSystem(SDL_INIT_AUDIO);
+  int ret = SDL_OpenAudio(&s, NULL);
+  if (ret == 0) {
+    opened = true;
+    SDL_PauseAudio(0);
+  } else {
+    Log("Can not open the audio device: %s", SDL_GetError());
+  }
+}
+
 static void audio_io_handler(uint32_t offset, int len, bool is_write) {
+  switch (offset / sizeof(uint32_t)) {
+    case reg_init:
+      if (is_write && audio_base[reg_init]) {
+        audio_init();
+        audio_base[reg_init] = 0;
+      }
+      break;
+    case reg_count:
+      if (is_write) {
+        // The guest writes the count it read plus the bytes it has appended,
+        // so the difference is added to `head` and the bytes drained by the
+        // callback in between are not lost.
+        uint32_t n = audio_base[reg_count] - last_count;
+        Assert(head + n - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) <= CONFIG_SB_SIZE,
+            "audio stream buffer overflow");
+        __atomic_store_n(&head, head + n, __ATOMIC_RELEASE);
+        last_count = audio_base[reg_count];
+      } else {
+        last_count = head - __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+        audio_base[reg_count] = last_count;
+      }
+      break;
+  }
 }
 
 void init_audio() {
@@ -42,6 +121,8 @@ void init_audio() {
   add_mmio_map("audio", CONFIG_AUDIO_CTL_MMIO, audio_base, space_size, audio_io_handler);
 #endif
 
+  audio_base[reg_sbuf_size] = CONFIG_SB_SIZE;
+
   sbuf = (uint8_t *)new_space(CONFIG_SB_SIZE);
   add_mmio_map("audio-sbuf", CONFIG_SB_ADDR, sbuf, CONFIG_SB_SIZE, NULL);
 }
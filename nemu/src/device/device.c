@@ -16,6 +16,7 @@
 #include <common.h>
 #include <utils.h>
 #include <device/alarm.h>
+#include <cpu/event.h>
 #ifndef CONFIG_TARGET_AM
 #include <SDL2/SDL.h>
 #endif
@@ -27,28 +28,31 @@ void init_vga();
 void init_i8042();
 void init_audio();
 void init_disk();
+void init_net();
 void init_sdcard();
-void init_alarm();
+void init_virtio_blk();
+void init_virtio_console();
 
 void send_key(uint8_t, bool);
 void vga_update_screen();
-
-void device_update() {
-  static uint64_t last = 0;
-  uint64_t now = get_time();
-  if (now - last < 1000000 / TIMER_HZ) {
-    return;
-  }
-  last = now;
-
-  IFDEF(CONFIG_HAS_VGA, vga_update_screen());
+void serial_update();
+void virtio_console_update();
+void net_update();
 
 #ifndef CONFIG_TARGET_AM
+// set by the thread which polls SDL events, and handled by device updates
+static bool quit_requested = false;
+
+/* Handle the pending SDL events. This is called by the thread owning the
+ * window, i.e. the render thread of VGA, so the CPU thread never waits for
+ * the window system. Keys go through the lock-free key queue.
+ */
+void sdl_poll_events() {
   SDL_Event event;
   while (SDL_PollEvent(&event)) {
     switch (event.type) {
       case SDL_QUIT:
-        nemu_state.state = NEMU_QUIT;
+        __atomic_store_n(&quit_requested, true, __ATOMIC_RELAXED);
         break;
 #ifdef CONFIG_HAS_KEYBOARD
       // If a key was pressed
@@ -63,16 +67,63 @@ void device_update() {
       default: break;
     }
   }
-#endif
 }
+#endif
+
+static void device_update() {
+  IFNDEF(CONFIG_TARGET_AM, alarm_tick());
+  IFDEF(CONFIG_HAS_VGA, vga_update_screen());
+  IFDEF(CONFIG_HAS_SERIAL, serial_update());
+  IFDEF(CONFIG_HAS_VIRTIO_CONSOLE, virtio_console_update());
+  IFDEF(CONFIG_HAS_NET, net_update());
 
-void sdl_clear_event_queue() {
 #ifndef CONFIG_TARGET_AM
-  SDL_Event event;
-  while (SDL_PollEvent(&event));
+  if (__atomic_exchange_n(&quit_requested, false, __ATOMIC_RELAXED)) {
+    nemu_state.state = NEMU_QUIT;
+  }
 #endif
 }
 
+// Devices are updated at TIMER_HZ of host time. Instead of checking the host
+// time after every instruction, the next check is an event scheduled after the
+// number of instructions the guest is expected to run until the update is due.
+// With --icount, updates follow guest time instead, so they happen at exact
+// instruction counts.
+#define TICK_MIN_DELAY 1024
+#define TICK_MAX_DELAY (1 << 20)
+
+static void device_tick() {
+  extern uint64_t g_nr_guest_inst;
+  static uint64_t last = 0, prev_time = 0, prev_inst = 0;
+  uint64_t period = 1000000 / TIMER_HZ;
+  if (g_icount_shift >= 0) {
+    // the update is due exactly after a period of guest time
+    device_update();
+    event_add(device_tick, icount_from_us(period));
+    return;
+  }
+
+  uint64_t now = get_time();
+  if (now - last >= period) {
+    last = now;
+    device_update();
+  }
+
+  // the speed of the guest since the last check
+  uint64_t nr_inst = g_nr_guest_inst - prev_inst, time = now - prev_time;
+  prev_inst = g_nr_guest_inst;
+  prev_time = now;
+  uint64_t delay = (time == 0 ? TICK_MAX_DELAY : nr_inst * (last + period - now) / time);
+  if (delay < TICK_MIN_DELAY) delay = TICK_MIN_DELAY;
+  if (delay > TICK_MAX_DELAY) delay = TICK_MAX_DELAY;
+  event_add(device_tick, delay);
+}
+
+void sdl_clear_event_queue() {
+  // drop the quit request which arrived while the guest was stopped
+  IFNDEF(CONFIG_TARGET_AM, __atomic_store_n(&quit_requested, false, __ATOMIC_RELAXED));
+}
+
 void init_device() {
   IFDEF(CONFIG_TARGET_AM, ioe_init());
   init_map();
@@ -83,7 +134,10 @@ void init_device() {
   IFDEF(CONFIG_HAS_KEYBOARD, init_i8042());
   IFDEF(CONFIG_HAS_AUDIO, init_audio());
   IFDEF(CONFIG_HAS_DISK, init_disk());
+  IFDEF(CONFIG_HAS_NET, init_net());
   IFDEF(CONFIG_HAS_SDCARD, init_sdcard());
+  IFDEF(CONFIG_HAS_VIRTIO_BLK, init_virtio_blk());
+  IFDEF(CONFIG_HAS_VIRTIO_CONSOLE, init_virtio_console());
 
-  IFNDEF(CONFIG_TARGET_AM, init_alarm());
+  event_add(device_tick, (g_icount_shift >= 0 ? icount_from_us(1000000 / TIMER_HZ) : 0));
 }
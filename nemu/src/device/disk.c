@@ -14,6 +14,89 @@
 ***************************************************************************************/
 
 #include <device/map.h>
+#include <memory/paddr.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define BLKSZ 512
+
+// A transfer is described by reg_buf (guest physical address), reg_blkno,
+// reg_blkcnt and reg_write, and writing reg_start moves all its blocks
+// between the image and the guest memory with one memcpy.
+enum {
+  reg_blksz,
+  reg_nr_blk, // number of blocks in the image
+  reg_buf,
+  reg_blkno,
+  reg_blkcnt,
+  reg_write,
+  reg_start,
+  nr_reg
+};
+
+static uint32_t *disk_base = NULL;
+// the disk image is mapped, and written back by msync() at exit
+static uint8_t *img = NULL;
+static uint64_t img_size = 0;
+
+static void disk_blkio() {
+  paddr_t buf = disk_base[reg_buf];
+  uint64_t blkno = disk_base[reg_blkno];
+  uint64_t len = (uint64_t)disk_base[reg_blkcnt] * BLKSZ;
+  if (len == 0) return;
+  Assert(in_pmem_range(buf, len),
+      "disk I/O out of physical memory: buf = " FMT_PADDR ", len = %" PRIu64, buf, len);
+  uint64_t pos = blkno * BLKSZ;
+  // the part out of the image reads as zeros and ignores writes
+  uint64_t n = (pos >= img_size ? 0 : (pos + len > img_size ? img_size - pos : len));
+  if (disk_base[reg_write]) {
+    memcpy(img + pos, guest_to_host(buf), n);
+  } else {
+    memcpy(guest_to_host(buf), img + pos, n);
+    memset(guest_to_host(buf) + n, 0, len - n);
+    paddr_dma_write(buf, len);
+  }
+}
+
+static void disk_io_handler(uint32_t offset, int len, bool is_write) {
+  if (is_write && offset == reg_start * sizeof(uint32_t)) {
+    disk_blkio();
+  }
+}
+
+static void disk_sync() {
+  msync(img, img_size, MS_SYNC);
+}
+
+static void init_img(const char *path) {
+  if (path[0] == '\0') return;
+  int fd = open(path, O_RDWR);
+  if (fd == -1) { Log("Can not find disk image: %s", path); return; }
+  struct stat st;
+  int ret = fstat(fd, &st);
+  Assert(ret == 0, "Can not stat disk image: %s", path);
+  img_size = st.st_size / BLKSZ * BLKSZ;
+  if (img_size > 0) {
+    img = mmap(NULL, img_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    Assert(img != MAP_FAILED, "Can not map disk image: %s", path);
+    atexit(disk_sync);
+  }
+  close(fd);
+  Log("Disk image %s, %" PRIu64 " blocks", path, img_size / BLKSZ);
+}
 
 void init_disk() {
+  uint32_t space_size = sizeof(uint32_t) * nr_reg;
+  disk_base = (uint32_t *)new_space(space_size);
+#ifdef CONFIG_HAS_PORT_IO
+  add_pio_map ("disk", CONFIG_DISK_CTL_PORT, disk_base, space_size, disk_io_handler);
+#else
+  add_mmio_map("disk", CONFIG_DISK_CTL_MMIO, disk_base, space_size, disk_io_handler);
+#endif
+
+  init_img(CONFIG_DISK_IMG_PATH);
+  disk_base[reg_blksz] = BLKSZ;
+  disk_base[reg_nr_blk] = img_size / BLKSZ;
 }
@@ -21,12 +21,18 @@ SRCS-$(CONFIG_HAS_KEYBOARD) += src/device/keyboard.c
 SRCS-$(CONFIG_HAS_VGA) += src/device/vga.c
 SRCS-$(CONFIG_HAS_AUDIO) += src/device/audio.c
 SRCS-$(CONFIG_HAS_DISK) += src/device/disk.c
+SRCS-$(CONFIG_HAS_NET) += src/device/net.c
 SRCS-$(CONFIG_HAS_SDCARD) += src/device/sdcard.c
+SRCS-$(CONFIG_HAS_VIRTIO_BLK) += src/device/virtio-blk.c
+SRCS-$(CONFIG_HAS_VIRTIO_CONSOLE) += src/device/virtio-console.c
+ifneq ($(CONFIG_HAS_VIRTIO_BLK)$(CONFIG_HAS_VIRTIO_CONSOLE),)
+SRCS-y += src/device/virtio.c
+endif
 
 SRCS-BLACKLIST-$(CONFIG_TARGET_AM) += src/device/alarm.c
 
 ifdef CONFIG_DEVICE
 ifndef CONFIG_TARGET_AM
-LIBS += $(shell sdl2-config --libs)
+LIBS += $(shell sdl2-config --libs) -lpthread
 endif
 endif
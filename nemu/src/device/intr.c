@@ -13,7 +13,24 @@
 * See the Mulan PSL v2 for more details.
 ***************************************************************************************/
 
-#include <isa.h>
 
-void dev_raise_intr() {
+#include <device/intr.h>
+#include <cpu/event.h>
+
+static uint32_t intr_pending = 0;
+
+void dev_raise_intr(int irq) {
+  __atomic_fetch_or(&intr_pending, 1u << irq, __ATOMIC_RELEASE);
+  // An expired deadline makes the CPU loop stop at the next block boundary.
+  // If another thread races with the CPU thread updating the deadline, the
+  // interrupt stays pending and is seen at the next event.
+  __atomic_store_n(&g_event_deadline, 0, __ATOMIC_RELAXED);
+}
+
+void dev_clear_intr(int irq) {
+  __atomic_fetch_and(&intr_pending, ~(1u << irq), __ATOMIC_RELAXED);
+}
+
+uint32_t dev_intr_pending() {
+  return __atomic_load_n(&intr_pending, __ATOMIC_ACQUIRE);
 }
@@ -29,9 +29,28 @@ uint8_t* new_space(int size) {
   size = (size + (PAGE_SIZE - 1)) & ~PAGE_MASK;
   p_space += size;
   assert(p_space - io_space < IO_SPACE_MAX);
+  checkpoint_add("io space", io_space, p_space - io_space, NULL);
   return p;
 }
 
+IOMap* map_list_add(IOMapList *list, const char *name, paddr_t addr,
+    void *space, uint32_t len, io_callback_t callback) {
+  if (list->nr == list->max) {
+    list->max = (list->max == 0 ? 16 : list->max * 2);
+    list->map = realloc(list->map, sizeof(list->map[0]) * list->max);
+    assert(list->map);
+  }
+  IOMap *map = malloc(sizeof(*map));
+  assert(map);
+  *map = (IOMap){ .name = name, .low = addr, .high = addr + len - 1,
+    .space = space, .callback = callback };
+  int i = list->nr;
+  for (; i > 0 && list->map[i - 1]->low > map->low; i --) list->map[i] = list->map[i - 1];
+  list->map[i] = map;
+  list->nr ++;
+  return map;
+}
+
 static void check_bound(IOMap *map, paddr_t addr) {
   if (map == NULL) {
     Assert(map != NULL, "address (" FMT_PADDR ") is out of bound at pc = " FMT_WORD, addr, cpu.pc);
@@ -52,8 +71,11 @@ void init_map() {
   p_space = io_space;
 }
 
+uint64_t g_nr_map_access = 0;
+
 word_t map_read(paddr_t addr, int len, IOMap *map) {
   assert(len >= 1 && len <= 8);
+  g_nr_map_access ++;
   check_bound(map, addr);
   paddr_t offset = addr - map->low;
   invoke_callback(map->callback, offset, len, false); // prepare data to read
@@ -63,6 +85,7 @@ word_t map_read(paddr_t addr, int len, IOMap *map) {
 
 void map_write(paddr_t addr, int len, word_t data, IOMap *map) {
   assert(len >= 1 && len <= 8);
+  g_nr_map_access ++;
   check_bound(map, addr);
   paddr_t offset = addr - map->low;
   host_write(map->space + offset, len, data);
@@ -45,26 +45,87 @@ static void init_keymap() {
   MAP(NEMU_KEYS, SDL_KEYMAP)
 }
 
+// Keys are sent by the thread polling SDL events and received by the CPU
+// thread, through a single-producer/single-consumer ring. Each side only
+// writes its own index, so no lock is needed. Keys are dropped when the
+// guest does not drain the ring.
 #define KEY_QUEUE_LEN 1024
 static int key_queue[KEY_QUEUE_LEN] = {};
 static int key_f = 0, key_r = 0;
 
 static void key_enqueue(uint32_t am_scancode) {
-  key_queue[key_r] = am_scancode;
-  key_r = (key_r + 1) % KEY_QUEUE_LEN;
-  Assert(key_r != key_f, "key queue overflow!");
+  static uint64_t nr_drop = 0;
+  int r = key_r;
+  int next = (r + 1) % KEY_QUEUE_LEN;
+  if (next == __atomic_load_n(&key_f, __ATOMIC_ACQUIRE)) {
+    if (nr_drop ++ == 0) Log("key queue is full, dropping keys");
+    return;
+  }
+  key_queue[r] = am_scancode;
+  __atomic_store_n(&key_r, next, __ATOMIC_RELEASE);
+}
+
+// With --record-input, each key read by the guest is written as a line of
+// "<guest instructions> <key> <1 if down, 0 if up>". With --replay-input, the
+// keys are read from such a file instead of SDL, and each key is returned by
+// the first read of the guest at or after its instruction count. Keys are
+// recorded when the guest reads them, rather than when SDL delivers them,
+// because only the former happens at a deterministic point of the guest.
+extern uint64_t g_nr_guest_inst;
+static FILE *record_fp = NULL, *replay_fp = NULL;
+static uint64_t replay_inst = UINT64_MAX;
+static uint32_t replay_key = NEMU_KEY_NONE;
+
+static void replay_next() {
+  unsigned key;
+  int down;
+  if (fscanf(replay_fp, "%" SCNu64 " %u %d", &replay_inst, &key, &down) == 3) {
+    replay_key = key | (down ? KEYDOWN_MASK : 0);
+  } else {
+    replay_inst = UINT64_MAX;
+  }
+}
+
+void init_key_record(const char *record_file, const char *replay_file) {
+  if (record_file != NULL) {
+    record_fp = fopen(record_file, "w");
+    Assert(record_fp, "Can not open '%s'", record_file);
+    // runs ended by panic() or assert() skip the stdio flush at exit, and the
+    // recording of such a run is the one to keep
+    setvbuf(record_fp, NULL, _IOLBF, 0);
+    Log("Recording keys to %s", record_file);
+  }
+  if (replay_file != NULL) {
+    replay_fp = fopen(replay_file, "r");
+    Assert(replay_fp, "Can not open '%s'", replay_file);
+    Log("Replaying keys from %s", replay_file);
+    replay_next();
+  }
 }
 
 static uint32_t key_dequeue() {
   uint32_t key = NEMU_KEY_NONE;
-  if (key_f != key_r) {
-    key = key_queue[key_f];
-    key_f = (key_f + 1) % KEY_QUEUE_LEN;
+  if (replay_fp != NULL) {
+    if (g_nr_guest_inst >= replay_inst) {
+      key = replay_key;
+      replay_next();
+    }
+  } else {
+    int f = key_f;
+    if (f != __atomic_load_n(&key_r, __ATOMIC_ACQUIRE)) {
+      key = key_queue[f];
+      __atomic_store_n(&key_f, (f + 1) % KEY_QUEUE_LEN, __ATOMIC_RELEASE);
+    }
+  }
+  if (record_fp != NULL && key != NEMU_KEY_NONE) {
+    fprintf(record_fp, "%" PRIu64 " %u %d\n", g_nr_guest_inst, key & ~KEYDOWN_MASK, (key & KEYDOWN_MASK) != 0);
   }
   return key;
 }
 
 void send_key(uint8_t scancode, bool is_keydown) {
+  // keys from SDL are ignored when replaying
+  if (replay_fp != NULL) return;
   if (nemu_state.state == NEMU_RUNNING && keymap[scancode] != NEMU_KEY_NONE) {
     uint32_t am_scancode = keymap[scancode] | (is_keydown ? KEYDOWN_MASK : 0);
     key_enqueue(am_scancode);
@@ -96,5 +157,10 @@ void init_i8042() {
 #else
   add_mmio_map("keyboard", CONFIG_I8042_DATA_MMIO, i8042_data_port_base, 4, i8042_data_io_handler);
 #endif
-  IFNDEF(CONFIG_TARGET_AM, init_keymap());
+#ifndef CONFIG_TARGET_AM
+  init_keymap();
+  checkpoint_add("key queue", key_queue, sizeof(key_queue), NULL);
+  checkpoint_add("key front", &key_f, sizeof(key_f), NULL);
+  checkpoint_add("key rear", &key_r, sizeof(key_r), NULL);
+#endif
 }
@@ -0,0 +1,270 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <device/map.h>
+#include <device/intr.h>
+#include <memory/paddr.h>
+#include <utils.h>
+#ifdef CONFIG_NET_BACKEND_SOCKET
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#define MTU 1514 // the largest ethernet frame without FCS
+
+// The TX ring and the RX ring are arrays of NetDesc in the guest memory, and
+// their heads and tails are running counts. The guest puts frames in the TX
+// ring and writes reg_tx_tail, then the device sends all of them at once. The
+// guest posts empty buffers in the RX ring and writes reg_rx_tail, then the
+// device fills them with received frames, also at each device update. Every
+// frame is moved with one memcpy between the guest memory and the backend.
+enum {
+  reg_mtu,
+  reg_tx_ring, reg_tx_size, reg_tx_head, reg_tx_tail,
+  reg_rx_ring, reg_rx_size, reg_rx_head, reg_rx_tail,
+  nr_reg
+};
+
+#define DESC_DONE 1
+
+typedef struct {
+  uint32_t addr;
+  uint16_t len; // the size of the buffer, set to the length of the frame on RX
+  uint16_t flags;
+} NetDesc;
+
+static uint32_t *net_base = NULL;
+static uint64_t nr_tx = 0, tx_bytes = 0, nr_rx = 0, rx_bytes = 0, nr_drop = 0;
+
+// backends
+// ====================================================
+// backend_send() returns false if the frame is dropped, and backend_recv()
+// returns the length of the frame, or -1 if there is none
+
+#if defined(CONFIG_NET_BACKEND_LOOPBACK)
+#define LOOP_NR 64
+static uint8_t loop_frame[LOOP_NR][MTU];
+static uint16_t loop_len[LOOP_NR];
+static uint32_t loop_head = 0, loop_tail = 0;
+
+static void backend_init() {
+  Log("Network card in loopback");
+}
+
+static bool backend_send(const void *buf, int len) {
+  if (loop_tail - loop_head == LOOP_NR) return false;
+  memcpy(loop_frame[loop_tail % LOOP_NR], buf, len);
+  loop_len[loop_tail % LOOP_NR] = len;
+  loop_tail ++;
+  return true;
+}
+
+static int backend_recv(void *buf, int size) {
+  if (loop_head == loop_tail) return -1;
+  int len = loop_len[loop_head % LOOP_NR];
+  if (len > size) len = size;
+  memcpy(buf, loop_frame[loop_head % LOOP_NR], len);
+  loop_head ++;
+  return len;
+}
+
+#elif defined(CONFIG_NET_BACKEND_SOCKET)
+static int sock_fd = -1;
+static struct sockaddr_un peer = { .sun_family = AF_UNIX };
+
+static void sock_cleanup() {
+  unlink(CONFIG_NET_SOCKET_PATH);
+}
+
+static void backend_init() {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  strncpy(addr.sun_path, CONFIG_NET_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+  strncpy(peer.sun_path, CONFIG_NET_SOCKET_PEER, sizeof(peer.sun_path) - 1);
+  sock_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  Assert(sock_fd != -1, "Can not create the socket of the network card");
+  unlink(addr.sun_path);
+  int ret = bind(sock_fd, (struct sockaddr *)&addr, sizeof(addr));
+  Assert(ret == 0, "Can not bind the socket of the network card to %s", addr.sun_path);
+  atexit(sock_cleanup);
+  Log("Network card on %s, peer %s", addr.sun_path, peer.sun_path);
+}
+
+static bool backend_send(const void *buf, int len) {
+  // the frame is dropped if the peer is not there or can not take it now
+  return sendto(sock_fd, buf, len, 0, (struct sockaddr *)&peer, sizeof(peer)) == len;
+}
+
+static int backend_recv(void *buf, int size) {
+  int len = recv(sock_fd, buf, size, 0);
+  return (len < 0 ? -1 : len);
+}
+
+#elif defined(CONFIG_NET_BACKEND_PCAP)
+typedef struct {
+  uint32_t magic;
+  uint16_t major, minor;
+  int32_t zone;
+  uint32_t sigfigs, snaplen, linktype;
+} PcapHeader;
+
+typedef struct {
+  uint32_t sec, frac, caplen, len;
+} PcapRecord;
+
+static FILE *pcap_in = NULL, *pcap_out = NULL;
+
+static void pcap_close() {
+  if (pcap_out) fclose(pcap_out);
+}
+
+static void backend_init() {
+  PcapHeader hdr;
+  if (CONFIG_NET_PCAP_IN[0] != '\0') {
+    pcap_in = fopen(CONFIG_NET_PCAP_IN, "rb");
+    Assert(pcap_in, "Can not open %s", CONFIG_NET_PCAP_IN);
+    int ret = fread(&hdr, sizeof(hdr), 1, pcap_in);
+    // timestamps are ignored, so both microsecond and nanosecond files are fine
+    Assert(ret == 1 && (hdr.magic == 0xa1b2c3d4 || hdr.magic == 0xa1b23c4d) && hdr.linktype == 1,
+        "%s is not a little-endian pcap file of ethernet frames", CONFIG_NET_PCAP_IN);
+    Log("Network card replays %s", CONFIG_NET_PCAP_IN);
+  }
+  if (CONFIG_NET_PCAP_OUT[0] != '\0') {
+    pcap_out = fopen(CONFIG_NET_PCAP_OUT, "wb");
+    Assert(pcap_out, "Can not open %s", CONFIG_NET_PCAP_OUT);
+    hdr = (PcapHeader) { .magic = 0xa1b2c3d4, .major = 2, .minor = 4, .snaplen = 65535, .linktype = 1 };
+    fwrite(&hdr, sizeof(hdr), 1, pcap_out);
+    atexit(pcap_close);
+    Log("Network card writes frames to %s", CONFIG_NET_PCAP_OUT);
+  }
+}
+
+static bool backend_send(const void *buf, int len) {
+  if (pcap_out == NULL) return true;
+  uint64_t us = get_guest_time();
+  PcapRecord rec = { .sec = us / 1000000, .frac = us % 1000000, .caplen = len, .len = len };
+  fwrite(&rec, sizeof(rec), 1, pcap_out);
+  fwrite(buf, len, 1, pcap_out);
+  return true;
+}
+
+static int backend_recv(void *buf, int size) {
+  if (pcap_in == NULL) return -1;
+  PcapRecord rec;
+  if (fread(&rec, sizeof(rec), 1, pcap_in) != 1) {
+    Log("Network card reaches the end of %s", CONFIG_NET_PCAP_IN);
+    fclose(pcap_in);
+    pcap_in = NULL;
+    return -1;
+  }
+  // the part of the frame out of the buffer is skipped
+  int len = (rec.caplen > size ? size : rec.caplen);
+  int ret = fread(buf, len, 1, pcap_in);
+  Assert(len == 0 || ret == 1, "Truncated frame in %s", CONFIG_NET_PCAP_IN);
+  fseek(pcap_in, rec.caplen - len, SEEK_CUR);
+  return len;
+}
+#endif
+
+// rings
+// ====================================================
+
+static NetDesc* get_desc(paddr_t ring, uint32_t size, uint32_t idx) {
+  uint64_t addr = (uint64_t)ring + (uint64_t)(idx % size) * sizeof(NetDesc);
+  Assert(in_pmem_range(addr, sizeof(NetDesc)),
+      "network ring out of physical memory: addr = 0x%" PRIx64, addr);
+  return (NetDesc *)guest_to_host(addr);
+}
+
+static uint8_t* get_buf(NetDesc *d) {
+  Assert(in_pmem_range(d->addr, d->len),
+      "network buffer out of physical memory: addr = " FMT_PADDR ", len = %d", (paddr_t)d->addr, d->len);
+  // backends pass the buffer to the host kernel directly
+  pmem_prefault(d->addr, d->len);
+  return guest_to_host(d->addr);
+}
+
+static void net_recv_frames() {
+  uint32_t size = net_base[reg_rx_size];
+  if (size == 0) return;
+  bool received = false;
+  while (net_base[reg_rx_head] != net_base[reg_rx_tail]) {
+    NetDesc *d = get_desc(net_base[reg_rx_ring], size, net_base[reg_rx_head]);
+    int len = backend_recv(get_buf(d), d->len);
+    if (len < 0) break;
+    paddr_dma_write(d->addr, len);
+    d->len = len;
+    d->flags = DESC_DONE;
+    paddr_dma_write(host_to_guest((uint8_t *)d), sizeof(*d));
+    net_base[reg_rx_head] ++;
+    nr_rx ++;
+    rx_bytes += len;
+    received = true;
+  }
+  if (received) dev_raise_intr(IRQ_NET);
+}
+
+static void net_send_frames() {
+  uint32_t size = net_base[reg_tx_size];
+  if (size == 0) return;
+  while (net_base[reg_tx_head] != net_base[reg_tx_tail]) {
+    NetDesc *d = get_desc(net_base[reg_tx_ring], size, net_base[reg_tx_head]);
+    Assert(d->len <= MTU, "frame of %d bytes is larger than MTU", d->len);
+    if (backend_send(get_buf(d), d->len)) {
+      nr_tx ++;
+      tx_bytes += d->len;
+    } else {
+      nr_drop ++;
+    }
+    d->flags = DESC_DONE;
+    paddr_dma_write(host_to_guest((uint8_t *)d), sizeof(*d));
+    net_base[reg_tx_head] ++;
+  }
+  // frames sent to the loopback are received at once
+  IFDEF(CONFIG_NET_BACKEND_LOOPBACK, net_recv_frames());
+}
+
+static void net_io_handler(uint32_t offset, int len, bool is_write) {
+  if (!is_write) return;
+  switch (offset / sizeof(uint32_t)) {
+    case reg_tx_tail: net_send_frames(); break;
+    case reg_rx_tail: net_recv_frames(); break;
+  }
+}
+
+void net_update() {
+  net_recv_frames();
+}
+
+void net_statistic(uint64_t host_us) {
+  if (nr_tx + nr_rx + nr_drop == 0) return;
+  Log("network frames: tx = %'" PRIu64 " (%'" PRIu64 " bytes), rx = %'" PRIu64
+      " (%'" PRIu64 " bytes), dropped = %'" PRIu64, nr_tx, tx_bytes, nr_rx, rx_bytes, nr_drop);
+  if (host_us > 0) Log("network throughput = %'" PRIu64 " frames/s",
+      (nr_tx + nr_rx) * 1000000 / host_us);
+}
+
+void init_net() {
+  uint32_t space_size = sizeof(uint32_t) * nr_reg;
+  net_base = (uint32_t *)new_space(space_size);
+#ifdef CONFIG_HAS_PORT_IO
+  add_pio_map ("net", CONFIG_NET_CTL_PORT, net_base, space_size, net_io_handler);
+#else
+  add_mmio_map("net", CONFIG_NET_CTL_MMIO, net_base, space_size, net_io_handler);
+#endif
+  net_base[reg_mtu] = MTU;
+  checkpoint_add("net", net_base, space_size, NULL);
+  backend_init();
+}
@@ -14,6 +14,11 @@
 ***************************************************************************************/
 
 #include <device/map.h>
+#include <memory/paddr.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "mmc.h"
 
 // http://www.files.e-shop.co.il/pdastore/Tech-mmc-samsung/SEC%20MMC%20SPEC%20ver09.pdf
@@ -28,8 +33,11 @@
 #define C_SIZE (NR_BLOCK / MULT - 1)
 
 // This is a simple hardware implementation of linux/drivers/mmc/host/bcm2835.c
-// No DMA and IRQ is supported, so the driver must be modified to start PIO
+// No IRQ is supported, so the driver must be modified to start PIO
 // right after sending the actual read/write commands.
+// Instead of PIO through SDDATA, the driver may write a guest physical address
+// to SDDMA after a read/write command, which transfers all the blocks set by
+// MMC_SET_BLOCK_COUNT (or one block) at once.
 
 enum {
   SDCMD, SDARG, SDTOUT, SDCDIV,
@@ -37,10 +45,13 @@ enum {
   SDHSTS, __PAD0, __PAD1, __PAD2,
   SDVDD, SDEDM, SDHCFG, SDHBCT,
   SDDATA, __PAD10, __PAD11, __PAD12,
-  SDHBLC
+  SDHBLC, __PAD20, __PAD21, __PAD22,
+  SDDMA
 };
 
-static FILE *fp = NULL;
+// the sdcard image is mapped, and written back by msync() at exit
+static uint8_t *img = NULL;
+static uint64_t img_size = 0;
 static uint32_t *base = NULL;
 static uint32_t blkcnt = 0;
 static long blk_addr = 0;
@@ -51,10 +62,34 @@ static bool read_ext_csd = false;
 static void prepare_rw(int is_write) {
   blk_addr = base[SDARG];
   addr = 0;
-  if (fp) fseek(fp, blk_addr << 9, SEEK_SET);
   write_cmd = is_write;
 }
 
+// return the image at the current position if [pos, pos + len) is in it
+static uint8_t* img_at(uint64_t len) {
+  uint64_t pos = ((uint64_t)blk_addr << 9) + addr;
+  return (img != NULL && pos + len <= img_size ? img + pos : NULL);
+}
+
+static void sdcard_dma(paddr_t buf) {
+  uint64_t total = (uint64_t)(blkcnt == 0 ? 1 : blkcnt) * 512;
+  if (addr >= total) return;
+  uint64_t len = total - addr;
+  Assert(in_pmem_range(buf, len),
+      "sdcard DMA out of physical memory: addr = " FMT_PADDR ", len = %" PRIu64, buf, len);
+  uint8_t *p = img_at(len);
+  if (p == NULL) {
+    // out of the image, read as zeros and ignore writes
+    if (!write_cmd) memset(guest_to_host(buf), 0, len);
+  } else if (!write_cmd) {
+    memcpy(guest_to_host(buf), p, len);
+  } else {
+    memcpy(p, guest_to_host(buf), len);
+  }
+  if (!write_cmd) paddr_dma_write(buf, len);
+  addr += len;
+}
+
 static void sdcard_handle_cmd(int cmd) {
   switch (cmd) {
     case MMC_GO_IDLE_STATE: break;
@@ -109,26 +144,50 @@ static void sdcard_io_handler(uint32_t offset, int len, bool is_write) {
          }
          base[SDDATA] = data;
          if (addr == 512 - 4) read_ext_csd = false;
-       } else if (fp) {
-         __attribute__((unused)) int ret;
-         if (!write_cmd) { ret = fread(&base[SDDATA], 4, 1, fp); }
-         else { ret = fwrite(&base[SDDATA], 4, 1, fp); }
+       } else {
+         uint8_t *p = img_at(4);
+         if (!write_cmd) { base[SDDATA] = (p ? *(uint32_t *)p : 0); }
+         else if (p) { *(uint32_t *)p = base[SDDATA]; }
        }
        addr += 4;
        break;
+    case SDDMA: if (is_write) sdcard_dma(base[SDDMA]); break;
     default:
       Log("offset = 0x%x(idx = %d), is_write = %d, data = 0x%x", offset, idx, is_write, base[idx]);
       panic("unhandle offset = %d", offset);
   }
 }
 
+static void sdcard_sync() {
+  if (img != NULL) msync(img, img_size, MS_SYNC);
+}
+
+static void init_img(const char *path) {
+  int fd = open(path, O_RDWR);
+  if (fd == -1) { Log("Can not find sdcard image: %s", path); return; }
+  struct stat st;
+  int ret = fstat(fd, &st);
+  Assert(ret == 0, "Can not stat sdcard image: %s", path);
+  img_size = st.st_size;
+  if (img_size > 0) {
+    img = mmap(NULL, img_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    Assert(img != MAP_FAILED, "Can not map sdcard image: %s", path);
+    atexit(sdcard_sync);
+  }
+  close(fd);
+}
+
 void init_sdcard() {
   base = (uint32_t *)new_space(0x80);
   add_mmio_map("sdhci", CONFIG_SDCARD_CTL_MMIO, base, 0x80, sdcard_io_handler);
 
   Assert(C_SIZE < (1 << 12), "shoule be fit in 12 bits");
 
-  const char *img = CONFIG_SDCARD_IMG_PATH;
-  fp = fopen(img, "r+");
-  if (fp == NULL) Log("Can not find sdcard image: %s", img);
+  init_img(CONFIG_SDCARD_IMG_PATH);
+
+  checkpoint_add("sdcard blkcnt", &blkcnt, sizeof(blkcnt), NULL);
+  checkpoint_add("sdcard cmd", &write_cmd, sizeof(write_cmd), NULL);
+  checkpoint_add("sdcard ext_csd", &read_ext_csd, sizeof(read_ext_csd), NULL);
+  checkpoint_add("sdcard blk_addr", &blk_addr, sizeof(blk_addr), NULL);
+  checkpoint_add("sdcard addr", &addr, sizeof(addr), NULL);
 }
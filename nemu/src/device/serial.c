@@ -20,12 +20,87 @@
 // NOTE: this is compatible to 16550
 
 #define CH_OFFSET 0
+#define LSR_OFFSET 5
+#define LSR_TX_READY 0x20
+#define LSR_TX_EMPTY 0x40
+#define LSR_RX_READY 0x01
 
 static uint8_t *serial_base = NULL;
 
+#ifndef CONFIG_TARGET_AM
+// Output is buffered and written to the host stderr on a newline, when the
+// buffer is full, at each device update, when cpu_exec() returns and at exit.
+// panic() and Assert() end in abort(), which skips the flush at exit, so
+// assert_fail_msg() flushes the buffer as well.
+static char obuf[4096];
+static int nr_obuf = 0;
+
+void serial_flush() {
+  if (nr_obuf == 0) return;
+  __attribute__((unused)) size_t ret = fwrite(obuf, 1, nr_obuf, stderr);
+  nr_obuf = 0;
+}
+
+static void serial_putc(char ch) {
+  obuf[nr_obuf ++] = ch;
+  if (ch == '\n' || nr_obuf == sizeof(obuf)) serial_flush();
+}
+#else
+void serial_flush() {}
 
 static void serial_putc(char ch) {
-  MUXDEF(CONFIG_TARGET_AM, putch(ch), putc(ch, stderr));
+  putch(ch);
+}
+#endif
+
+#ifdef CONFIG_SERIAL_INPUT_FIFO
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+// Input is read without blocking from the named pipe FIFO_PATH, e.g. with
+// `cat > /tmp/nemu.serial`, into a queue which the guest drains through RBR.
+// The queue is refilled at each device update once it is empty, so polling
+// LSR does not make a system call.
+#define FIFO_PATH "/tmp/nemu.serial"
+#define QUEUE_SIZE 1024
+static char queue[QUEUE_SIZE];
+static int f = 0, r = 0;
+static int fifo_fd = -1;
+
+static void serial_refill() {
+  if (f != r) return;
+  f = 0;
+  int n = read(fifo_fd, queue, QUEUE_SIZE);
+  r = (n > 0 ? n : 0);
+}
+
+static bool serial_rx_ready() {
+  return f != r;
+}
+
+static uint8_t serial_getc() {
+  return (serial_rx_ready() ? queue[f ++] : 0xff);
+}
+
+static void init_fifo() {
+  int ret = mkfifo(FIFO_PATH, 0666);
+  Assert(ret == 0 || errno == EEXIST, "Can not create %s", FIFO_PATH);
+  // also open it for writing, so that it does not hit EOF when a writer exits
+  fifo_fd = open(FIFO_PATH, O_RDWR | O_NONBLOCK);
+  Assert(fifo_fd != -1, "Can not open %s", FIFO_PATH);
+  Log("Serial input is read from %s", FIFO_PATH);
+}
+#else
+static void serial_refill() {}
+static bool serial_rx_ready() { return false; }
+static uint8_t serial_getc() { return 0xff; }
+#endif
+
+void serial_update() {
+  serial_flush();
+  serial_refill();
 }
 
 static void serial_io_handler(uint32_t offset, int len, bool is_write) {
@@ -34,9 +109,15 @@ static void serial_io_handler(uint32_t offset, int len, bool is_write) {
     /* We bind the serial port with the host stderr in NEMU. */
     case CH_OFFSET:
       if (is_write) serial_putc(serial_base[0]);
-      else panic("do not support read");
+      else serial_base[0] = serial_getc();
+      break;
+    case LSR_OFFSET:
+      if (!is_write) {
+        serial_base[LSR_OFFSET] = LSR_TX_READY | LSR_TX_EMPTY | (serial_rx_ready() ? LSR_RX_READY : 0);
+      }
       break;
-    default: panic("do not support offset = %d", offset);
+    // the other registers only configure the line, and are ignored
+    default: break;
   }
 }
 
@@ -48,4 +129,6 @@ void init_serial() {
   add_mmio_map("serial", CONFIG_SERIAL_MMIO, serial_base, 8, serial_io_handler);
 #endif
 
+  IFDEF(CONFIG_SERIAL_INPUT_FIFO, init_fifo());
+  atexit(serial_flush);
 }
@@ -15,14 +15,53 @@
 
 #include <device/map.h>
 #include <device/alarm.h>
+#include <device/intr.h>
 #include <utils.h>
+#include <cpu/event.h>
+#include <isa.h>
 
 static uint32_t *rtc_port_base = NULL;
 
+#ifdef CONFIG_RTC_SPIN_SKIP
+// A guest waiting for a deadline, e.g. the next frame, reads the RTC again
+// and again from the same pc, with the same few instructions in between and
+// no access to other devices. Such a loop idles until the next event instead
+// of being interpreted. Stores are not checked, since the timer driver of AM
+// stores each reading to the stack.
+#define SPIN_MAX_GAP 64
+#define SPIN_THRESHOLD 64
+
+static uint64_t nr_rtc_access = 0;
+
+static void check_spin() {
+  extern uint64_t g_nr_guest_inst;
+  static vaddr_t last_pc = 0;
+  static uint64_t last_inst = 0, last_gap = 0, last_map_access = 0, last_rtc_access = 0;
+  static int nr_spin = 0;
+  uint64_t gap = g_nr_guest_inst - last_inst;
+  bool rtc_only = (g_nr_map_access - last_map_access == nr_rtc_access - last_rtc_access);
+  if (cpu.pc == last_pc && gap <= SPIN_MAX_GAP && gap == last_gap && rtc_only) {
+    if (++ nr_spin >= SPIN_THRESHOLD) {
+      nr_spin = 0;
+      event_idle();
+    }
+  } else {
+    nr_spin = 0;
+  }
+  last_pc = cpu.pc;
+  last_inst = g_nr_guest_inst;
+  last_gap = gap;
+  last_map_access = g_nr_map_access;
+  last_rtc_access = nr_rtc_access;
+}
+#endif
+
 static void rtc_io_handler(uint32_t offset, int len, bool is_write) {
   assert(offset == 0 || offset == 4);
+  IFDEF(CONFIG_RTC_SPIN_SKIP, nr_rtc_access ++);
   if (!is_write && offset == 4) {
-    uint64_t us = get_time();
+    IFDEF(CONFIG_RTC_SPIN_SKIP, check_spin());
+    uint64_t us = get_guest_time();
     rtc_port_base[0] = (uint32_t)us;
     rtc_port_base[1] = us >> 32;
   }
@@ -31,8 +70,7 @@ static void rtc_io_handler(uint32_t offset, int len, bool is_write) {
 #ifndef CONFIG_TARGET_AM
 static void timer_intr() {
   if (nemu_state.state == NEMU_RUNNING) {
-    extern void dev_raise_intr();
-    dev_raise_intr();
+    dev_raise_intr(IRQ_TIMER);
   }
 }
 #endif
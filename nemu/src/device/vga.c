@@ -31,62 +31,414 @@ static uint32_t screen_size() {
   return screen_width() * screen_height() * sizeof(uint32_t);
 }
 
+enum {
+  reg_size,   // (width << 16) | height
+  reg_sync,
+  reg_vmemsz, // size of the GPU memory, 0 without acceleration
+  reg_cmd,    // writing a command executes it with the arguments below
+  reg_arg0,
+  reg_arg1,
+  reg_arg2,
+  nr_reg
+};
+
 static void *vmem = NULL;
 static uint32_t *vgactl_port_base = NULL;
 
-#ifdef CONFIG_VGA_SHOW_SCREEN
-#ifndef CONFIG_TARGET_AM
-#include <SDL2/SDL.h>
+#if defined(CONFIG_VGA_SHOW_SCREEN) || defined(CONFIG_VGA_HEADLESS)
+// Writes to vmem are plain stores through the physical page table. The rows
+// changed since the last frame are found by comparing vmem with `frame` when
+// the guest syncs, and only these rows are drawn.
+static uint32_t *frame = NULL; // the last synced frame
+
+// Return whether any row has changed since the last frame, and the range
+// [*y0, *y1) of the changed rows.
+static bool find_dirty_rows(int *y0, int *y1) {
+  uint32_t *fb = vmem;
+  int w = screen_width(), h = screen_height(), y;
+  *y0 = h; *y1 = 0;
+  for (y = 0; y < h; y ++) {
+    if (memcmp(fb + y * w, frame + y * w, w * sizeof(uint32_t)) != 0) {
+      if (y < *y0) *y0 = y;
+      *y1 = y + 1;
+    }
+  }
+  return *y0 < *y1;
+}
+
+static void copy_rows(int y0, int y1) {
+  int w = screen_width();
+  memcpy(frame + y0 * w, (uint32_t *)vmem + y0 * w, (y1 - y0) * w * sizeof(uint32_t));
+}
+
+#ifdef CONFIG_VGA_HEADLESS
+#include <utils.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// The shared memory object seen by an external viewer. `seq` is odd while a
+// frame is being copied into `pixel`, so a viewer should read `seq`, copy the
+// pixels, and retry if `seq` was odd or has changed in between.
+typedef struct {
+  char magic[8]; // "NEMUVGA1"
+  uint32_t width, height;
+  volatile uint64_t seq;
+  uint32_t pixel[];
+} VGAShm;
 
-static SDL_Renderer *renderer = NULL;
-static SDL_Texture *texture = NULL;
+static VGAShm *shm = NULL;
+static char shm_name[64];
+
+// The recording starts with the magic "NEMUVRC1" and the width, height and
+// tile size as uint32_t. Each synced frame is then recorded as the guest time
+// in us (uint64_t) and the number of changed tiles (uint32_t), followed by the
+// changed tiles. A tile is its pixel position x, y (uint16_t), followed by its
+// pixels row by row, clipped at the right and bottom of the screen.
+#define TILE 16
+#define NR_TILE_X ((SCREEN_W + TILE - 1) / TILE)
+#define NR_TILE_Y ((SCREEN_H + TILE - 1) / TILE)
+
+static FILE *record_fp = NULL;
+
+void init_vga_record(const char *file) {
+  record_fp = fopen(file, "wb");
+  Assert(record_fp, "Can not open '%s'", file);
+  uint32_t hdr[3] = { SCREEN_W, SCREEN_H, TILE };
+  fwrite("NEMUVRC1", 8, 1, record_fp);
+  fwrite(hdr, sizeof(hdr), 1, record_fp);
+  Log("Recording the screen to %s", file);
+}
+
+static bool tile_changed(int x, int y, int w, int h) {
+  uint32_t *fb = vmem;
+  for (int i = y; i < y + h; i ++) {
+    if (memcmp(fb + i * SCREEN_W + x, frame + i * SCREEN_W + x, w * sizeof(uint32_t)) != 0) return true;
+  }
+  return false;
+}
+
+// record the tiles in rows [y0, y1) which differ from `frame`
+static void record_frame(int y0, int y1) {
+  static uint16_t tiles[NR_TILE_X * NR_TILE_Y][2];
+  uint32_t nr = 0;
+  for (int y = y0 / TILE * TILE; y < y1; y += TILE) {
+    int h = (y + TILE > SCREEN_H ? SCREEN_H - y : TILE);
+    for (int x = 0; x < SCREEN_W; x += TILE) {
+      int w = (x + TILE > SCREEN_W ? SCREEN_W - x : TILE);
+      if (tile_changed(x, y, w, h)) { tiles[nr][0] = x; tiles[nr][1] = y; nr ++; }
+    }
+  }
+
+  uint64_t time = get_guest_time();
+  fwrite(&time, sizeof(time), 1, record_fp);
+  fwrite(&nr, sizeof(nr), 1, record_fp);
+  for (int i = 0; i < nr; i ++) {
+    int x = tiles[i][0], y = tiles[i][1];
+    int w = (x + TILE > SCREEN_W ? SCREEN_W - x : TILE);
+    int h = (y + TILE > SCREEN_H ? SCREEN_H - y : TILE);
+    fwrite(tiles[i], sizeof(tiles[i]), 1, record_fp);
+    for (int j = y; j < y + h; j ++) {
+      fwrite((uint32_t *)vmem + j * SCREEN_W + x, sizeof(uint32_t), w, record_fp);
+    }
+  }
+}
+
+static void remove_shm() {
+  shm_unlink(shm_name);
+}
 
 static void init_screen() {
+  char *name = shm_name;
+  sprintf(name, "/nemu-vga-%d", getpid());
+  size_t size = sizeof(VGAShm) + SCREEN_W * SCREEN_H * sizeof(uint32_t);
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  Assert(fd != -1, "Can not create the shared memory object '%s'", name);
+  int ret = ftruncate(fd, size);
+  Assert(ret == 0, "Can not resize the shared memory object '%s'", name);
+  shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  Assert(shm != MAP_FAILED, "Can not map the shared memory object '%s'", name);
+  close(fd);
+  atexit(remove_shm);
+  memcpy(shm->magic, "NEMUVGA1", 8);
+  shm->width = SCREEN_W;
+  shm->height = SCREEN_H;
+  Log("Publishing the screen to the shared memory object %s", name);
+}
+
+static inline void update_screen() {
+  int y0, y1;
+  if (!find_dirty_rows(&y0, &y1)) return;
+  if (record_fp != NULL) record_frame(y0, y1);
+  copy_rows(y0, y1);
+  shm->seq ++;
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(shm->pixel + y0 * SCREEN_W, frame + y0 * SCREEN_W, (y1 - y0) * SCREEN_W * sizeof(uint32_t));
+  __atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELEASE);
+}
+#elif !defined(CONFIG_TARGET_AM)
+#include <SDL2/SDL.h>
+#include <pthread.h>
+
+// A render thread uploads the dirty rows of `frame` and presents them, so the
+// CPU thread never waits for the display. It draws from its own copy of the
+// frame, which is refreshed under `lock` from the rows in [dirty_y0, dirty_y1).
+// As it owns the window, it also polls the SDL events.
+#define POLL_INTERVAL_MS 10
+
+void sdl_poll_events();
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int dirty_y0 = SCREEN_H, dirty_y1 = 0;
+
+static void* render_thread(void *arg) {
+  static uint32_t front[SCREEN_W * SCREEN_H] = {};
   SDL_Window *window = NULL;
+  SDL_Renderer *renderer = NULL;
   char title[128];
   sprintf(title, "%s-NEMU", str(__GUEST_ISA__));
-  SDL_Init(SDL_INIT_VIDEO);
   SDL_CreateWindowAndRenderer(
       SCREEN_W * (MUXDEF(CONFIG_VGA_SIZE_400x300, 2, 1)),
       SCREEN_H * (MUXDEF(CONFIG_VGA_SIZE_400x300, 2, 1)),
       0, &window, &renderer);
   SDL_SetWindowTitle(window, title);
-  texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
+  SDL_Texture *texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
       SDL_TEXTUREACCESS_STATIC, SCREEN_W, SCREEN_H);
   SDL_RenderPresent(renderer);
+
+  while (true) {
+    struct timespec timeout;
+    clock_gettime(CLOCK_REALTIME, &timeout);
+    timeout.tv_nsec += POLL_INTERVAL_MS * 1000000;
+    if (timeout.tv_nsec >= 1000000000) { timeout.tv_sec ++; timeout.tv_nsec -= 1000000000; }
+
+    pthread_mutex_lock(&lock);
+    while (dirty_y0 >= dirty_y1) {
+      if (pthread_cond_timedwait(&cond, &lock, &timeout) != 0) break;
+    }
+    int y0 = dirty_y0, y1 = dirty_y1;
+    if (y0 < y1) {
+      memcpy(front + y0 * SCREEN_W, frame + y0 * SCREEN_W, (y1 - y0) * SCREEN_W * sizeof(uint32_t));
+      dirty_y0 = SCREEN_H;
+      dirty_y1 = 0;
+    }
+    pthread_mutex_unlock(&lock);
+
+    sdl_poll_events();
+    if (y0 >= y1) continue;
+
+    SDL_Rect rect = { .x = 0, .y = y0, .w = SCREEN_W, .h = y1 - y0 };
+    SDL_UpdateTexture(texture, &rect, front + y0 * SCREEN_W, SCREEN_W * sizeof(uint32_t));
+    SDL_RenderClear(renderer);
+    SDL_RenderCopy(renderer, texture, NULL, NULL);
+    SDL_RenderPresent(renderer);
+  }
+  return NULL;
+}
+
+static void init_screen() {
+  SDL_Init(SDL_INIT_VIDEO);
+  pthread_t thread;
+  int ret = pthread_create(&thread, NULL, render_thread, NULL);
+  Assert(ret == 0, "Can not create the render thread");
+  pthread_detach(thread);
 }
 
 static inline void update_screen() {
-  SDL_UpdateTexture(texture, NULL, vmem, SCREEN_W * sizeof(uint32_t));
-  SDL_RenderClear(renderer);
-  SDL_RenderCopy(renderer, texture, NULL, NULL);
-  SDL_RenderPresent(renderer);
+  int y0, y1;
+  // only this thread writes `frame`, so it can be read without the lock
+  if (!find_dirty_rows(&y0, &y1)) return;
+  pthread_mutex_lock(&lock);
+  copy_rows(y0, y1);
+  if (y0 < dirty_y0) dirty_y0 = y0;
+  if (y1 > dirty_y1) dirty_y1 = y1;
+  pthread_cond_signal(&cond);
+  pthread_mutex_unlock(&lock);
 }
 #else
 static void init_screen() {}
 
 static inline void update_screen() {
-  io_write(AM_GPU_FBDRAW, 0, 0, vmem, screen_width(), screen_height(), true);
+  int y0, y1;
+  if (!find_dirty_rows(&y0, &y1)) return;
+  copy_rows(y0, y1);
+  int w = screen_width();
+  io_write(AM_GPU_FBDRAW, 0, y0, frame + y0 * w, w, y1 - y0, true);
 }
 #endif
 #endif
 
+#ifdef CONFIG_VGA_ACCEL
+#include <memory/paddr.h>
+
+// Acceleration commands. Positions and sizes are packed as (x << 16) | y
+// and (w << 16) | h, and are clipped to the screen.
+enum {
+  GPU_CMD_MEMCPY = 1, // copy arg2 bytes from guest memory at arg1 to GPU memory at arg0
+  GPU_CMD_RENDER,     // render the canvas tree at arg0 in GPU memory to the screen
+  GPU_CMD_FILL,       // fill the rectangle at arg0 of size arg1 with the color arg2
+  GPU_CMD_BLIT,       // copy the pixels at arg2 in guest memory to the rectangle at arg0 of size arg1
+};
+
+// mirror `struct gpu_canvas` in abstract-machine/am/include/amdev.h
+#define GPU_TEXTURE 1
+#define GPU_SUBTREE 2
+#define GPU_NULL    0xffffffff
+
+typedef struct {
+  uint16_t type, w, h, x1, y1, w1, h1;
+  uint32_t sibling;
+  union {
+    uint32_t child;
+    struct { uint16_t w, h; uint32_t pixels; } __attribute__((packed)) texture;
+  };
+} __attribute__((packed)) GPUCanvas;
+
+static uint8_t *gpumem = NULL;
+// scratch buffers for the subtrees of a canvas tree
+static uint32_t *gpubuf = NULL, *gpubuf_top = NULL;
+static int gpu_nr_node = 0;
+#define GPU_MAX_DEPTH 64 // render() recurses on subtrees
+
+static void* gpu_to_host(uint32_t ptr, uint64_t size) {
+  Assert((uint64_t)ptr + size <= CONFIG_VGA_ACCEL_MEM_SIZE,
+      "GPU memory access out of bound: ptr = 0x%x, size = %" PRIu64, ptr, size);
+  return gpumem + ptr;
+}
+
+static void* guest_pixels(paddr_t addr, uint64_t size) {
+  Assert(in_pmem_range(addr, size),
+      "GPU source out of physical memory: addr = " FMT_PADDR ", size = %" PRIu64, addr, size);
+  return guest_to_host(addr);
+}
+
+// Draw the w * h pixels at `src` to the rectangle (x, y) - (x + dw, y + dh)
+// of the pw * ph canvas `dst`, scaling them with the nearest pixel.
+static void draw(uint32_t *dst, int pw, int ph, int x, int y, int dw, int dh,
+    uint32_t *src, int w, int h) {
+  int cw = (x + dw > pw ? pw - x : dw);
+  int ch = (y + dh > ph ? ph - y : dh);
+  if (cw <= 0 || ch <= 0 || w == 0 || h == 0) return;
+  if (dw == w && dh == h) {
+    for (int j = 0; j < ch; j ++) {
+      memcpy(dst + (y + j) * pw + x, src + j * w, cw * sizeof(uint32_t));
+    }
+    return;
+  }
+  for (int j = 0; j < ch; j ++) {
+    uint32_t *d = dst + (y + j) * pw + x;
+    uint32_t *s = src + (int64_t)j * h / dh * w;
+    for (int i = 0; i < cw; i ++) d[i] = s[(int64_t)i * w / dw];
+  }
+}
+
+static void render(GPUCanvas *cv, uint32_t *dst, int pw, int ph, int depth) {
+  gpu_nr_node ++;
+  Assert(gpu_nr_node <= CONFIG_VGA_ACCEL_MEM_SIZE / sizeof(GPUCanvas), "loop in the canvas tree");
+  Assert(depth <= GPU_MAX_DEPTH, "canvas tree deeper than %d", GPU_MAX_DEPTH);
+
+  uint32_t *src;
+  int w, h;
+  switch (cv->type) {
+    case GPU_TEXTURE:
+      w = cv->texture.w; h = cv->texture.h;
+      src = gpu_to_host(cv->texture.pixels, (uint64_t)w * h * sizeof(uint32_t));
+      break;
+    case GPU_SUBTREE: {
+      w = cv->w; h = cv->h;
+      uint64_t size = (uint64_t)w * h;
+      Assert(size <= (uint64_t)(gpubuf + CONFIG_VGA_ACCEL_MEM_SIZE / sizeof(uint32_t) - gpubuf_top),
+          "canvas tree too large");
+      src = gpubuf_top;
+      gpubuf_top += size;
+      memset(src, 0, size * sizeof(uint32_t));
+      for (uint32_t p = cv->child; p != GPU_NULL; ) {
+        GPUCanvas *child = gpu_to_host(p, sizeof(GPUCanvas));
+        render(child, src, w, h, depth + 1);
+        p = child->sibling;
+      }
+      break;
+    }
+    default: panic("invalid canvas type %d", cv->type);
+  }
+  draw(dst, pw, ph, cv->x1, cv->y1, cv->w1, cv->h1, src, w, h);
+}
+
+static void gpu_exec(uint32_t cmd) {
+  uint32_t *fb = vmem;
+  int W = screen_width(), H = screen_height();
+  uint32_t arg0 = vgactl_port_base[reg_arg0];
+  uint32_t arg1 = vgactl_port_base[reg_arg1];
+  uint32_t arg2 = vgactl_port_base[reg_arg2];
+  int x = arg0 >> 16, y = arg0 & 0xffff, w = arg1 >> 16, h = arg1 & 0xffff;
+
+  switch (cmd) {
+    case GPU_CMD_MEMCPY:
+      memcpy(gpu_to_host(arg0, arg2), guest_pixels(arg1, arg2), arg2);
+      break;
+    case GPU_CMD_RENDER:
+      gpubuf_top = gpubuf;
+      gpu_nr_node = 0;
+      render(gpu_to_host(arg0, sizeof(GPUCanvas)), fb, W, H, 0);
+      break;
+    case GPU_CMD_FILL: {
+      int cw = (x + w > W ? W - x : w);
+      int ch = (y + h > H ? H - y : h);
+      if (cw <= 0 || ch <= 0) break;
+      uint32_t *row = fb + y * W + x;
+      for (int i = 0; i < cw; i ++) row[i] = arg2;
+      for (int j = 1; j < ch; j ++) memcpy(row + j * W, row, cw * sizeof(uint32_t));
+      break;
+    }
+    case GPU_CMD_BLIT:
+      draw(fb, W, H, x, y, w, h, guest_pixels(arg2, (uint64_t)w * h * sizeof(uint32_t)), w, h);
+      break;
+    default: panic("invalid GPU command %d", cmd);
+  }
+}
+
+static void vga_io_handler(uint32_t offset, int len, bool is_write) {
+  if (is_write && offset == reg_cmd * sizeof(uint32_t)) {
+    gpu_exec(vgactl_port_base[reg_cmd]);
+  }
+}
+
+static void init_accel() {
+  gpumem = new_space(CONFIG_VGA_ACCEL_MEM_SIZE);
+  gpubuf = malloc(CONFIG_VGA_ACCEL_MEM_SIZE);
+  assert(gpubuf);
+  vgactl_port_base[reg_vmemsz] = CONFIG_VGA_ACCEL_MEM_SIZE;
+}
+#endif
+
 void vga_update_screen() {
-  // TODO: call `update_screen()` when the sync register is non-zero,
-  // then zero out the sync register
+  if (vgactl_port_base[reg_sync] != 0) {
+#if defined(CONFIG_VGA_SHOW_SCREEN) || defined(CONFIG_VGA_HEADLESS)
+    update_screen();
+#endif
+    vgactl_port_base[reg_sync] = 0;
+  }
 }
 
 void init_vga() {
-  vgactl_port_base = (uint32_t *)new_space(8);
-  vgactl_port_base[0] = (screen_width() << 16) | screen_height();
+  uint32_t space_size = sizeof(uint32_t) * nr_reg;
+  vgactl_port_base = (uint32_t *)new_space(space_size);
+  vgactl_port_base[reg_size] = (screen_width() << 16) | screen_height();
+  io_callback_t handler = MUXDEF(CONFIG_VGA_ACCEL, vga_io_handler, NULL);
 #ifdef CONFIG_HAS_PORT_IO
-  add_pio_map ("vgactl", CONFIG_VGA_CTL_PORT, vgactl_port_base, 8, NULL);
+  add_pio_map ("vgactl", CONFIG_VGA_CTL_PORT, vgactl_port_base, space_size, handler);
 #else
-  add_mmio_map("vgactl", CONFIG_VGA_CTL_MMIO, vgactl_port_base, 8, NULL);
+  add_mmio_map("vgactl", CONFIG_VGA_CTL_MMIO, vgactl_port_base, space_size, handler);
 #endif
+  IFDEF(CONFIG_VGA_ACCEL, init_accel());
 
   vmem = new_space(screen_size());
   add_mmio_map("vmem", CONFIG_FB_ADDR, vmem, screen_size(), NULL);
-  IFDEF(CONFIG_VGA_SHOW_SCREEN, init_screen());
-  IFDEF(CONFIG_VGA_SHOW_SCREEN, memset(vmem, 0, screen_size()));
+#if defined(CONFIG_VGA_SHOW_SCREEN) || defined(CONFIG_VGA_HEADLESS)
+  memset(vmem, 0, screen_size());
+  frame = calloc(1, screen_size());
+  assert(frame);
+  init_screen();
+#endif
 }
@@ -0,0 +1,131 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <device/virtio.h>
+#include <device/intr.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// A request is a chain of a read-only header, the data buffers and a
+// writable status byte. All requests in the available ring are served at
+// the notification, each with one memcpy per data buffer.
+
+#define SECTOR_SIZE 512
+
+#define VIRTIO_BLK_T_IN     0
+#define VIRTIO_BLK_T_OUT    1
+#define VIRTIO_BLK_T_FLUSH  4
+#define VIRTIO_BLK_T_GET_ID 8
+
+#define VIRTIO_BLK_S_OK     0
+#define VIRTIO_BLK_S_IOERR  1
+#define VIRTIO_BLK_S_UNSUPP 2
+
+typedef struct {
+  uint32_t type, reserved;
+  uint64_t sector;
+} VirtioBlkReq;
+
+// the image is mapped, and written back by msync() at exit
+static uint8_t *img = NULL;
+static uint64_t img_size = 0;
+
+static uint8_t blk_request(VirtChain *c, uint32_t *written) {
+  if (c->nr_seg < 2 || c->seg[0].len < sizeof(VirtioBlkReq)) return VIRTIO_BLK_S_IOERR;
+  VirtioBlkReq *req = (VirtioBlkReq *)c->seg[0].buf;
+  uint64_t pos = req->sector * SECTOR_SIZE;
+  int i;
+  switch (req->type) {
+    case VIRTIO_BLK_T_IN:
+    case VIRTIO_BLK_T_OUT:
+      for (i = 1; i < c->nr_seg - 1; i ++) {
+        uint32_t len = c->seg[i].len;
+        if (pos > img_size || len > img_size - pos) return VIRTIO_BLK_S_IOERR;
+        if (req->type == VIRTIO_BLK_T_IN) { memcpy(c->seg[i].buf, img + pos, len); *written += len; }
+        else { memcpy(img + pos, c->seg[i].buf, len); }
+        pos += len;
+      }
+      return VIRTIO_BLK_S_OK;
+    case VIRTIO_BLK_T_FLUSH:
+      if (img != NULL) msync(img, img_size, MS_SYNC);
+      return VIRTIO_BLK_S_OK;
+    case VIRTIO_BLK_T_GET_ID:
+      if (c->nr_seg > 2) {
+        uint32_t len = (c->seg[1].len < 20 ? c->seg[1].len : 20);
+        strncpy((char *)c->seg[1].buf, "nemu-virtio-blk", len);
+        *written += len;
+      }
+      return VIRTIO_BLK_S_OK;
+    default: return VIRTIO_BLK_S_UNSUPP;
+  }
+}
+
+static void blk_notify(VirtioDev *dev, int q) {
+  VirtChain c;
+  while (virtq_pop(dev, q, &c)) {
+    // the last segment is the status byte, without which the request is
+    // returned unserved
+    uint8_t *status = c.seg[c.nr_seg - 1].buf;
+    if (!c.seg[c.nr_seg - 1].write || c.seg[c.nr_seg - 1].len < 1) {
+      virtq_push(dev, q, &c, 0);
+      continue;
+    }
+    uint32_t written = 0;
+    *status = blk_request(&c, &written);
+    virtq_push(dev, q, &c, written + 1);
+  }
+}
+
+static VirtioDev blk = {
+  .name = "virtio-blk",
+  .device_id = VIRTIO_ID_BLOCK,
+  .nr_queue = 1,
+  .irq = IRQ_VIRTIO_BLK,
+  .notify = blk_notify,
+};
+
+static void blk_io_handler(uint32_t offset, int len, bool is_write) {
+  virtio_mmio_access(&blk, offset, len, is_write);
+}
+
+static void blk_sync() {
+  msync(img, img_size, MS_SYNC);
+}
+
+static void init_img(const char *path) {
+  if (path[0] == '\0') return;
+  int fd = open(path, O_RDWR);
+  if (fd == -1) { Log("Can not find virtio-blk image: %s", path); return; }
+  struct stat st;
+  int ret = fstat(fd, &st);
+  Assert(ret == 0, "Can not stat virtio-blk image: %s", path);
+  img_size = st.st_size / SECTOR_SIZE * SECTOR_SIZE;
+  if (img_size > 0) {
+    img = mmap(NULL, img_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    Assert(img != MAP_FAILED, "Can not map virtio-blk image: %s", path);
+    atexit(blk_sync);
+  }
+  close(fd);
+}
+
+void init_virtio_blk() {
+  init_img(CONFIG_VIRTIO_BLK_IMG_PATH);
+  virtio_init(&blk, CONFIG_VIRTIO_BLK_MMIO, blk_io_handler);
+  // config: the capacity in sectors
+  uint64_t capacity = img_size / SECTOR_SIZE;
+  memcpy(&blk.regs[VIRTIO_CONFIG / 4], &capacity, sizeof(capacity));
+}
@@ -0,0 +1,95 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <device/virtio.h>
+#include <device/intr.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+// Queue 0 receives input into the buffers posted by the driver, and queue 1
+// transmits the buffers of the driver to the host stderr, a whole chain at a
+// time. Input is read without blocking from CONFIG_VIRTIO_CONSOLE_FIFO at
+// device updates.
+
+#define RECEIVEQ  0
+#define TRANSMITQ 1
+
+static int fifo_fd = -1;
+static char pending[256];
+static int nr_pending = 0, pending_pos = 0;
+
+static void console_notify(VirtioDev *dev, int q) {
+  if (q != TRANSMITQ) return; // receive buffers are filled at device updates
+  VirtChain c;
+  int i;
+  while (virtq_pop(dev, q, &c)) {
+    for (i = 0; i < c.nr_seg; i ++) {
+      if (!c.seg[i].write) {
+        __attribute__((unused)) size_t ret = fwrite(c.seg[i].buf, 1, c.seg[i].len, stderr);
+      }
+    }
+    virtq_push(dev, q, &c, 0);
+  }
+}
+
+static VirtioDev console = {
+  .name = "virtio-console",
+  .device_id = VIRTIO_ID_CONSOLE,
+  .nr_queue = 2,
+  .irq = IRQ_VIRTIO_CONSOLE,
+  .notify = console_notify,
+};
+
+static void console_io_handler(uint32_t offset, int len, bool is_write) {
+  virtio_mmio_access(&console, offset, len, is_write);
+}
+
+void virtio_console_update() {
+  if (fifo_fd == -1) return;
+  if (pending_pos == nr_pending) {
+    int n = read(fifo_fd, pending, sizeof(pending));
+    nr_pending = (n > 0 ? n : 0);
+    pending_pos = 0;
+  }
+  VirtChain c;
+  while (pending_pos < nr_pending && virtq_pop(&console, RECEIVEQ, &c)) {
+    uint32_t written = 0;
+    int i;
+    for (i = 0; i < c.nr_seg && pending_pos < nr_pending; i ++) {
+      if (!c.seg[i].write) continue;
+      uint32_t n = nr_pending - pending_pos;
+      if (n > c.seg[i].len) n = c.seg[i].len;
+      memcpy(c.seg[i].buf, pending + pending_pos, n);
+      pending_pos += n;
+      written += n;
+    }
+    virtq_push(&console, RECEIVEQ, &c, written);
+  }
+}
+
+void init_virtio_console() {
+  virtio_init(&console, CONFIG_VIRTIO_CONSOLE_MMIO, console_io_handler);
+
+  const char *path = CONFIG_VIRTIO_CONSOLE_FIFO;
+  if (path[0] == '\0') return;
+  int ret = mkfifo(path, 0666);
+  Assert(ret == 0 || errno == EEXIST, "Can not create %s", path);
+  // also open it for writing, so that it does not hit EOF when a writer exits
+  fifo_fd = open(path, O_RDWR | O_NONBLOCK);
+  Assert(fifo_fd != -1, "Can not open %s", path);
+  Log("virtio-console input is read from %s", path);
+}
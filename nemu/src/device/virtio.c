@@ -0,0 +1,172 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <device/map.h>
+#include <device/intr.h>
+#include <utils.h>
+#include <device/virtio.h>
+#include <memory/paddr.h>
+#include <stddef.h>
+
+enum {
+  MagicValue        = 0x000, Version           = 0x004,
+  DeviceID          = 0x008, VendorID          = 0x00c,
+  DeviceFeatures    = 0x010, DeviceFeaturesSel = 0x014,
+  DriverFeatures    = 0x020, DriverFeaturesSel = 0x024,
+  QueueSel          = 0x030, QueueNumMax       = 0x034,
+  QueueNum          = 0x038, QueueReady        = 0x044,
+  QueueNotify       = 0x050, InterruptStatus   = 0x060,
+  InterruptACK      = 0x064, Status            = 0x070,
+  QueueDescLow      = 0x080, QueueDescHigh     = 0x084,
+  QueueDriverLow    = 0x090, QueueDriverHigh   = 0x094,
+  QueueDeviceLow    = 0x0a0, QueueDeviceHigh   = 0x0a4,
+  ConfigGeneration  = 0x0fc,
+};
+
+#define VIRTQ_DESC_F_NEXT  1
+#define VIRTQ_DESC_F_WRITE 2
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+
+typedef struct {
+  uint64_t addr;
+  uint32_t len;
+  uint16_t flags, next;
+} VirtqDesc;
+
+// the host pointer of the guest memory [addr, addr + len)
+static void* guest_buf(uint64_t addr, uint64_t len) {
+  Assert(in_pmem_range(addr, len),
+      "virtio buffer out of physical memory: addr = 0x%" PRIx64 ", len = %" PRIu64, addr, len);
+  pmem_prefault(addr, len); // the console writes buffers to stderr directly
+  return guest_to_host(addr);
+}
+
+static void set_low(uint64_t *p, uint32_t v) { *p = (*p & ~0xffffffffull) | v; }
+static void set_high(uint64_t *p, uint32_t v) { *p = (*p & 0xffffffffull) | ((uint64_t)v << 32); }
+
+static void virtio_reset(VirtioDev *dev) {
+  dev->status = 0;
+  dev->intr_status = 0;
+  dev->driver_features = 0;
+  memset(dev->queue, 0, sizeof(dev->queue));
+  dev_clear_intr(dev->irq);
+}
+
+void virtio_mmio_access(VirtioDev *dev, uint32_t offset, int len, bool is_write) {
+  assert(len == 4 || offset >= VIRTIO_CONFIG);
+  if (offset >= VIRTIO_CONFIG) return; // the configuration is kept in `regs`
+  uint32_t *reg = &dev->regs[offset / 4];
+  VirtQueue *q = &dev->queue[dev->queue_sel < dev->nr_queue ? dev->queue_sel : 0];
+  bool valid_q = dev->queue_sel < dev->nr_queue;
+
+  if (!is_write) {
+    switch (offset) {
+      case MagicValue: *reg = 0x74726976; break; // "virt"
+      case Version: *reg = 2; break;
+      case DeviceID: *reg = dev->device_id; break;
+      case VendorID: *reg = 0x554d454e; break; // "NEMU"
+      case ConfigGeneration: *reg = 0; break;
+      case DeviceFeatures: *reg = (dev->features_sel < 2 ? dev->features >> (32 * dev->features_sel) : 0); break;
+      case QueueNumMax: *reg = (valid_q ? VIRTIO_QUEUE_MAX : 0); break;
+      case QueueReady: *reg = (valid_q ? q->ready : 0); break;
+      case InterruptStatus: *reg = dev->intr_status; break;
+      case Status: *reg = dev->status; break;
+      default: break;
+    }
+    return;
+  }
+
+  uint32_t v = *reg;
+  switch (offset) {
+    case DeviceFeaturesSel: dev->features_sel = v; break;
+    case DriverFeaturesSel: dev->driver_features_sel = v; break;
+    case DriverFeatures:
+      if (dev->driver_features_sel == 0) set_low(&dev->driver_features, v);
+      else if (dev->driver_features_sel == 1) set_high(&dev->driver_features, v);
+      break;
+    case QueueSel: dev->queue_sel = v; break;
+    case QueueNum:
+      Assert(v <= VIRTIO_QUEUE_MAX, "%s: queue size %d too large", dev->name, v);
+      if (valid_q) q->num = v;
+      break;
+    case QueueReady: if (valid_q) q->ready = v & 1; break;
+    case QueueDescLow:    if (valid_q) set_low(&q->desc, v); break;
+    case QueueDescHigh:   if (valid_q) set_high(&q->desc, v); break;
+    case QueueDriverLow:  if (valid_q) set_low(&q->avail, v); break;
+    case QueueDriverHigh: if (valid_q) set_high(&q->avail, v); break;
+    case QueueDeviceLow:  if (valid_q) set_low(&q->used, v); break;
+    case QueueDeviceHigh: if (valid_q) set_high(&q->used, v); break;
+    case QueueNotify: if (v < dev->nr_queue) dev->notify(dev, v); break;
+    case InterruptACK:
+      dev->intr_status &= ~v;
+      if (dev->intr_status == 0) dev_clear_intr(dev->irq);
+      break;
+    case Status:
+      if (v == 0) virtio_reset(dev);
+      else dev->status = v;
+      break;
+    default: break; // read-only registers
+  }
+}
+
+bool virtq_pop(VirtioDev *dev, int qi, VirtChain *c) {
+  VirtQueue *q = &dev->queue[qi];
+  if (!q->ready || q->num == 0) return false;
+  uint16_t *avail = guest_buf(q->avail, 4 + 2 * q->num);
+  if (q->last_avail == avail[1]) return false;
+
+  c->head = avail[2 + q->last_avail % q->num];
+  c->nr_seg = 0;
+  q->last_avail ++;
+  uint16_t i = c->head;
+  while (true) {
+    Assert(i < q->num, "%s: descriptor %d out of the queue", dev->name, i);
+    Assert(c->nr_seg < VIRTIO_MAX_SEG, "%s: descriptor chain too long", dev->name);
+    VirtqDesc *d = guest_buf(q->desc + i * sizeof(VirtqDesc), sizeof(VirtqDesc));
+    c->seg[c->nr_seg].buf = guest_buf(d->addr, d->len);
+    c->seg[c->nr_seg].len = d->len;
+    c->seg[c->nr_seg].write = (d->flags & VIRTQ_DESC_F_WRITE) != 0;
+    c->nr_seg ++;
+    if (!(d->flags & VIRTQ_DESC_F_NEXT)) break;
+    i = d->next;
+  }
+  return true;
+}
+
+void virtq_push(VirtioDev *dev, int qi, VirtChain *c, uint32_t len) {
+  VirtQueue *q = &dev->queue[qi];
+  int i;
+  for (i = 0; i < c->nr_seg; i ++) {
+    if (c->seg[i].write) paddr_dma_write(host_to_guest(c->seg[i].buf), c->seg[i].len);
+  }
+  uint16_t *used = guest_buf(q->used, 4 + 8 * q->num);
+  uint32_t *elem = (uint32_t *)(used + 2) + 2 * (used[1] % q->num);
+  elem[0] = c->head;
+  elem[1] = len;
+  used[1] ++;
+  paddr_dma_write(q->used, 4 + 8 * q->num);
+
+  dev->intr_status |= 1; // used buffer notification
+  uint16_t *avail = guest_buf(q->avail, 4);
+  if (!(avail[0] & VIRTQ_AVAIL_F_NO_INTERRUPT)) dev_raise_intr(dev->irq);
+}
+
+void virtio_init(VirtioDev *dev, paddr_t addr, void (*handler)(uint32_t, int, bool)) {
+  dev->regs = (uint32_t *)new_space(VIRTIO_MMIO_SIZE);
+  dev->features |= VIRTIO_F_VERSION_1;
+  virtio_reset(dev);
+  add_mmio_map(dev->name, addr, dev->regs, VIRTIO_MMIO_SIZE, handler);
+  checkpoint_add(dev->name, &dev->status, sizeof(VirtioDev) - offsetof(VirtioDev, status), NULL);
+}
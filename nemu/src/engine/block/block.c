@@ -0,0 +1,123 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <cpu/cpu.h>
+#include <cpu/decode.h>
+#include <memory/vaddr.h>
+#include "block.h"
+
+static Block blocks[NR_BLOCK] = {};
+static DecodeOp op_pool[NR_OP_POOL] = {};
+static int nr_op_used = 0;
+bool code_map[NR_CODE_MAP] = {};
+static bool block_init = false;
+
+// set when translated code is thrown away,
+// the running block should stop as soon as possible
+bool g_block_flushed = false;
+
+void block_flush() {
+  int i;
+  for (i = 0; i < NR_BLOCK; i ++) {
+    blocks[i].pc = BLOCK_INVALID;
+  }
+  memset(code_map, 0, sizeof(code_map));
+  nr_op_used = 0;
+  IFDEF(CONFIG_BLOCK_JIT, jit_flush());
+  g_block_flushed = true;
+}
+
+void block_invalidate(vaddr_t addr, int len) {
+  // code_map is indexed by words, so check each word written
+  vaddr_t word = addr & ~(vaddr_t)0x3;
+  int i, nr = ((addr & 0x3) + len + 3) / 4;
+  if (nr > NR_CODE_MAP) nr = NR_CODE_MAP;
+  for (i = 0; i < nr; i ++) {
+    if (unlikely(code_map[CODE_MAP_IDX(word + i * 4)])) {
+      block_flush();
+      return;
+    }
+  }
+}
+
+static uint64_t block_translate(Decode *s, Block *b, vaddr_t pc, uint64_t n) {
+  if (nr_op_used + BLOCK_MAX_OP > NR_OP_POOL) block_flush();
+  DecodeOp *op = &op_pool[nr_op_used];
+  g_block_flushed = false;
+
+  uint64_t nr = 0;
+  s->dnpc = pc;
+  do {
+    s->pc = s->dnpc;
+    s->snpc = s->pc;
+    code_map[CODE_MAP_IDX(s->pc)] = true;
+    isa_exec_record(s, &op[nr]);
+    cpu.pc = s->dnpc;
+    nr ++;
+  } while (nr < n && nr < BLOCK_MAX_OP && s->dnpc == s->snpc &&
+      nemu_state.state == NEMU_RUNNING && !g_block_flushed);
+
+  if (!g_block_flushed) {
+    // the block is executed successfully, keep it
+    b->pc = pc;
+    b->nr_op = nr;
+    b->op = op;
+#ifdef CONFIG_BLOCK_JIT
+    b->nr_exec = 0;
+    b->nr_native = 0;
+    b->native = NULL;
+#endif
+    nr_op_used += nr;
+  }
+  return nr;
+}
+
+#ifdef CONFIG_BLOCK_JIT
+static uint64_t block_exec_native(Decode *s, Block *b) {
+  int nr = b->native();
+  if (nr < b->nr_op && !g_block_flushed) {
+    // the rest of the block can not be compiled, interpret it
+    cpu.pc = b->op[nr].pc;
+    return nr + isa_exec_ops(s, b->op + nr, b->nr_op - nr);
+  }
+  // compiled instructions always fall through
+  s->pc = b->op[nr - 1].pc;
+  s->dnpc = s->pc + 4;
+  return nr;
+}
+#endif
+
+/* Execute at most `n` instructions from the block starting at `cpu.pc`.
+ * When it returns, `s->pc` is the pc of the last executed instruction,
+ * and `s->dnpc` is the pc of the next one.
+ */
+uint64_t block_exec(Decode *s, uint64_t n) {
+  if (unlikely(!block_init)) {
+    block_flush();
+    block_init = true;
+  }
+
+  vaddr_t pc = cpu.pc;
+  Block *b = &blocks[BLOCK_IDX(pc)];
+  if (likely(b->pc == pc)) {
+    g_block_flushed = false;
+#ifdef CONFIG_BLOCK_JIT
+    if (b->native != NULL && b->nr_op <= n) return block_exec_native(s, b);
+    if (++ b->nr_exec == CONFIG_BLOCK_JIT_THRESHOLD) jit_compile(b);
+#endif
+    return isa_exec_ops(s, b->op, (b->nr_op < n ? b->nr_op : n));
+  }
+  return block_translate(s, b, pc, n);
+}
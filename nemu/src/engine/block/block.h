@@ -0,0 +1,57 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __ENGINE_BLOCK_H__
+#define __ENGINE_BLOCK_H__
+
+#include <isa.h>
+
+// A block is a sequence of pre-decoded instructions which are executed
+// sequentially, starting from `pc`. It is recorded while the instructions
+// are executed for the first time, and ends at the first instruction which
+// does not fall through. A later execution leaves the block early if the
+// control flow goes somewhere else at an instruction inside the block.
+#define BLOCK_MAX_OP 64
+#define NR_BLOCK 4096
+#define NR_OP_POOL (NR_BLOCK * 16)
+#define BLOCK_IDX(pc) (((pc) >> 2) & (NR_BLOCK - 1))
+#define BLOCK_INVALID ((vaddr_t)1) // never a legal pc
+
+// words containing translated code, hashed by the word address
+#define NR_CODE_MAP (64 * 1024)
+#define CODE_MAP_IDX(addr) (((addr) >> 2) & (NR_CODE_MAP - 1))
+
+// native code of a block, returns the number of executed instructions
+typedef int (*NativeCode)();
+
+typedef struct {
+  vaddr_t pc;
+  int nr_op;
+  DecodeOp *op;
+#ifdef CONFIG_BLOCK_JIT
+  uint32_t nr_exec;
+  int nr_native; // the first `nr_native` ops are compiled into `native`
+  NativeCode native;
+#endif
+} Block;
+
+extern bool code_map[NR_CODE_MAP];
+
+#ifdef CONFIG_BLOCK_JIT
+void jit_flush();
+void jit_compile(Block *b);
+#endif
+
+#endif
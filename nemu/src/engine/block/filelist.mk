@@ -0,0 +1,21 @@
+#***************************************************************************************
+# Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+#
+# NEMU is licensed under Mulan PSL v2.
+# You can use this software according to the terms and conditions of the Mulan PSL v2.
+# You may obtain a copy of Mulan PSL v2 at:
+#          http://license.coscl.org.cn/MulanPSL2
+#
+# THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+# EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+# MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+#
+# See the Mulan PSL v2 for more details.
+#**************************************************************************************/
+
+# the block engine shares the monitor entry and host calls with the interpreter
+SRCS-$(CONFIG_ENGINE_BLOCK) += src/engine/interpreter/init.c src/engine/interpreter/hostcall.c
+
+ifndef CONFIG_BLOCK_JIT
+SRCS-BLACKLIST-y += src/engine/block/jit.c
+endif
@@ -0,0 +1,310 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+#include <cpu/cpu.h>
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
+#include <sys/mman.h>
+#include "block.h"
+
+// Compile hot blocks into x86-64 code. Only the instructions implemented by
+// the interpreter are compiled, and compilation of a block stops at the first
+// one which is not supported. The rest of the block is still interpreted.
+// Guest registers used most in a block are kept in callee-saved host registers,
+// and accesses to pmem go to the host memory directly unless they touch
+// translated code.
+
+#ifdef __x86_64__
+
+#define JIT_CACHE_SIZE (16 * 1024 * 1024)
+#define JIT_MIN_OP 4
+#define JIT_BLOCK_MAX_SIZE (BLOCK_MAX_OP * 256 + 256)
+
+#define NR_GPR MUXDEF(CONFIG_RVE, 16, 32)
+#define W MUXDEF(CONFIG_ISA64, 1, 0) // use 64-bit operations for guest values
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+// host registers for guest registers, all of them are callee-saved
+static const int alloc_reg[] = { RBP, R12, R13, R14, R15 };
+#define NR_ALLOC ARRLEN(alloc_reg)
+
+static uint8_t *code_cache = NULL;
+static uint8_t *code_end = NULL;
+static uint8_t *p = NULL; // the next byte to emit
+
+static int host_reg[NR_GPR]; // -1 if the guest register lives in `cpu.gpr`
+// Addresses are physical. Blocks are flushed when the translation changes,
+// so this holds as long as the native code is kept.
+static bool mmu_direct = true;
+static bool written[NR_GPR];
+
+void jit_flush() {
+  code_end = code_cache;
+}
+
+static void emit8(uint8_t b) { *p ++ = b; }
+static void emit32(uint32_t v) { memcpy(p, &v, 4); p += 4; }
+static void emit64(uint64_t v) { memcpy(p, &v, 8); p += 8; }
+
+static void emit_rex(int w, int reg, int base, bool force) {
+  uint8_t rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | (base >> 3);
+  if (rex != 0x40 || force) emit8(rex);
+}
+
+// op reg, rm
+static void emit_rr(uint8_t opcode, int w, int reg, int rm) {
+  emit_rex(w, reg, rm, false);
+  emit8(opcode);
+  emit8(0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// op reg, [base + disp32]
+static void emit_rm(uint8_t opcode, int w, int reg, int base, int32_t disp) {
+  emit_rex(w, reg, base, false);
+  emit8(opcode);
+  emit8(0x80 | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == RSP) emit8(0x24);
+  emit32(disp);
+}
+
+static void emit_mov_imm(int w, int r, uint64_t imm) {
+  emit_rex(w, 0, r, false);
+  emit8(0xb8 + (r & 7));
+  if (w) emit64(imm); else emit32(imm);
+}
+
+static void emit_call(void *fn) {
+  emit_mov_imm(1, RAX, (uintptr_t)fn);
+  emit8(0xff); emit8(0xd0); // call rax
+}
+
+// jcc/jmp rel32, return the position of rel32 to patch
+static uint8_t* emit_jcc(uint8_t cc) {
+  if (cc == 0) emit8(0xe9);
+  else { emit8(0x0f); emit8(cc); }
+  emit32(0);
+  return p - 4;
+}
+#define JMP 0
+#define JNE 0x85
+#define JAE 0x83
+
+static void patch(uint8_t *rel, uint8_t *target) {
+  int32_t off = target - (rel + 4);
+  memcpy(rel, &off, 4);
+}
+
+#define GPR_OFF(r) ((r) * (int)sizeof(word_t))
+
+static void load_gpr(int dst, int r) {
+  if (r == 0) emit_rr(0x31, 0, dst, dst); // xor dst, dst
+  else if (host_reg[r] >= 0) emit_rr(0x89, W, host_reg[r], dst);
+  else emit_rm(0x8b, W, dst, RBX, GPR_OFF(r));
+}
+
+static void store_gpr(int r, int src) {
+  if (r == 0) return;
+  if (host_reg[r] >= 0) emit_rr(0x89, W, src, host_reg[r]);
+  else emit_rm(0x89, W, src, RBX, GPR_OFF(r));
+}
+
+static void writeback() {
+  int r;
+  for (r = 1; r < NR_GPR; r ++) {
+    if (host_reg[r] >= 0 && written[r]) emit_rm(0x89, W, host_reg[r], RBX, GPR_OFF(r));
+  }
+}
+
+// rax = src1 + imm
+static void emit_addr(int rs1, word_t imm) {
+  load_gpr(RAX, rs1);
+  emit_rr(0x81, W, 0, RAX); emit32(imm); // add rax, imm32
+}
+
+// rcx = rax - MBASE, jump to the returned position if it is not in pmem
+static uint8_t* emit_pmem_check() {
+  if (!mmu_direct) return emit_jcc(JMP);
+  emit_rr(0x89, 1, RAX, RCX);
+  emit_mov_imm(1, RDX, CONFIG_MBASE);
+  emit_rr(0x29, 1, RDX, RCX); // sub rcx, rdx
+  emit_mov_imm(1, RDX, CONFIG_MSIZE);
+  emit_rr(0x39, 1, RDX, RCX); // cmp rcx, rdx
+  return emit_jcc(JAE);
+}
+
+// let the helpers see the same state as the interpreter
+static void emit_slow_path_enter(vaddr_t pc) {
+  writeback();
+  emit_mov_imm(1, RDX, (uintptr_t)&cpu.pc);
+  emit8(0xc7); emit8(0x02); emit32(pc); // mov dword [rdx], pc
+  IFDEF(CONFIG_ISA64, emit8(0xc7); emit8(0x42); emit8(0x04); emit32((uint64_t)pc >> 32));
+  emit_rr(0x89, W, RAX, RDI);
+}
+
+static void emit_lbu(DecodeOp *op) {
+  emit_addr(op->rs1, op->imm);
+  uint8_t *slow = emit_pmem_check();
+  emit_mov_imm(1, RDX, (uintptr_t)guest_to_host(CONFIG_MBASE));
+  emit8(0x0f); emit8(0xb6); emit8(0x0c); emit8(0x0a); // movzx ecx, byte [rdx + rcx]
+  uint8_t *done = emit_jcc(JMP);
+
+  patch(slow, p);
+  emit_slow_path_enter(op->pc);
+  emit_mov_imm(0, RSI, 1);
+  emit_call(vaddr_read);
+  emit_rr(0x89, 1, RAX, RCX);
+
+  patch(done, p);
+  store_gpr(op->rd, RCX);
+}
+
+static void emit_sb(DecodeOp *op, int nr_exec, uint8_t **exit) {
+  emit_addr(op->rs1, op->imm);
+  load_gpr(R8, op->rs2);
+  uint8_t *slow = emit_pmem_check();
+  // stores to translated code go to the slow path to flush the blocks
+  emit_rr(0x89, 1, RAX, RDX);
+  emit8(0x48); emit8(0xc1); emit8(0xea); emit8(0x02); // shr rdx, 2
+  emit_rr(0x81, 0, 4, RDX); emit32(NR_CODE_MAP - 1);  // and edx, mask
+  emit_mov_imm(1, RSI, (uintptr_t)code_map);
+  emit8(0x80); emit8(0x3c); emit8(0x16); emit8(0x00); // cmp byte [rsi + rdx], 0
+  uint8_t *slow2 = emit_jcc(JNE);
+  emit_mov_imm(1, RDX, (uintptr_t)guest_to_host(CONFIG_MBASE));
+  emit8(0x44); emit8(0x88); emit8(0x04); emit8(0x0a); // mov byte [rdx + rcx], r8b
+  uint8_t *done = emit_jcc(JMP);
+
+  patch(slow, p);
+  patch(slow2, p);
+  emit_slow_path_enter(op->pc);
+  emit_mov_imm(0, RSI, 1);
+  emit_rr(0x89, 1, R8, RDX);
+  emit_call(vaddr_write);
+  // leave if the store flushes translated code, including this block
+  emit_mov_imm(1, RAX, (uintptr_t)&g_block_flushed);
+  emit8(0x80); emit8(0x38); emit8(0x00); // cmp byte [rax], 0
+  uint8_t *flushed = emit_jcc(JNE);
+  uint8_t *done2 = emit_jcc(JMP);
+  patch(flushed, p);
+  emit_mov_imm(0, RAX, nr_exec);
+  *exit = emit_jcc(JMP);
+
+  patch(done, p);
+  patch(done2, p);
+}
+
+enum { OP_AUIPC, OP_LBU, OP_SB, OP_UNSUPPORTED };
+
+static int op_kind(DecodeOp *op) {
+  uint32_t i = op->inst;
+  if ((i & 0x7f) == 0x17) return OP_AUIPC;
+  if ((i & 0x707f) == 0x4003) return OP_LBU;
+  if ((i & 0x707f) == 0x0023) return OP_SB;
+  return OP_UNSUPPORTED;
+}
+
+static void alloc_gpr(DecodeOp *op, int nr) {
+  int use[NR_GPR] = {};
+  int i, j;
+  for (i = 0; i < NR_GPR; i ++) { host_reg[i] = -1; written[i] = false; }
+  for (i = 0; i < nr; i ++) {
+    switch (op_kind(&op[i])) {
+      case OP_AUIPC: use[op[i].rd] ++; written[op[i].rd] = true; break;
+      case OP_LBU: use[op[i].rd] ++; use[op[i].rs1] ++; written[op[i].rd] = true; break;
+      case OP_SB: use[op[i].rs1] ++; use[op[i].rs2] ++; break;
+    }
+  }
+  use[0] = 0;
+  for (j = 0; j < NR_ALLOC; j ++) {
+    int best = 0;
+    for (i = 1; i < NR_GPR; i ++) {
+      if (host_reg[i] < 0 && use[i] > use[best]) best = i;
+    }
+    if (best == 0) break;
+    host_reg[best] = alloc_reg[j];
+  }
+}
+
+void jit_compile(Block *b) {
+  if (unlikely(code_cache == NULL)) {
+    code_cache = mmap(NULL, JIT_CACHE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    Assert(code_cache != MAP_FAILED, "failed to allocate the JIT code cache");
+    code_end = code_cache;
+  }
+
+  int nr = 0;
+  while (nr < b->nr_op && op_kind(&b->op[nr]) != OP_UNSUPPORTED) nr ++;
+  // every entry loads and writes back the cached registers, so a short
+  // prefix followed by an interpreted tail is left to the interpreter
+  if (nr < b->nr_op && nr < JIT_MIN_OP) return;
+  if (code_end + JIT_BLOCK_MAX_SIZE > code_cache + JIT_CACHE_SIZE) {
+    block_flush();
+    return;
+  }
+
+  alloc_gpr(b->op, nr);
+  mmu_direct = (isa_mmu_check(b->pc, 4, MEM_TYPE_READ) == MMU_DIRECT);
+  p = code_end;
+  uint8_t *start = p;
+  uint8_t *exit[BLOCK_MAX_OP];
+  int nr_exit = 0;
+
+  // prologue, keep the stack aligned for calls
+  emit8(0x53); emit8(0x55); // push rbx, push rbp
+  emit8(0x41); emit8(0x54); emit8(0x41); emit8(0x55); // push r12, push r13
+  emit8(0x41); emit8(0x56); emit8(0x41); emit8(0x57); // push r14, push r15
+  emit8(0x48); emit8(0x83); emit8(0xec); emit8(0x08); // sub rsp, 8
+  emit_mov_imm(1, RBX, (uintptr_t)cpu.gpr);
+  int r;
+  for (r = 1; r < NR_GPR; r ++) {
+    if (host_reg[r] >= 0) emit_rm(0x8b, W, host_reg[r], RBX, GPR_OFF(r));
+  }
+
+  int i;
+  for (i = 0; i < nr; i ++) {
+    DecodeOp *op = &b->op[i];
+    switch (op_kind(op)) {
+      case OP_AUIPC:
+        emit_mov_imm(W, RCX, op->pc + op->imm);
+        store_gpr(op->rd, RCX);
+        break;
+      case OP_LBU: emit_lbu(op); break;
+      case OP_SB: emit_sb(op, i + 1, &exit[nr_exit ++]); break;
+    }
+  }
+  emit_mov_imm(0, RAX, nr);
+
+  // epilogue
+  for (i = 0; i < nr_exit; i ++) patch(exit[i], p);
+  writeback();
+  emit8(0x48); emit8(0x83); emit8(0xc4); emit8(0x08); // add rsp, 8
+  emit8(0x41); emit8(0x5f); emit8(0x41); emit8(0x5e); // pop r15, pop r14
+  emit8(0x41); emit8(0x5d); emit8(0x41); emit8(0x5c); // pop r13, pop r12
+  emit8(0x5d); emit8(0x5b); // pop rbp, pop rbx
+  emit8(0xc3); // ret
+
+  Assert(p - start <= JIT_BLOCK_MAX_SIZE, "native code of block at " FMT_WORD " is too large", b->pc);
+  code_end = p;
+  b->nr_native = nr;
+  b->native = (NativeCode)start;
+}
+
+#else
+
+// blocks are always interpreted on other hosts
+void jit_flush() {}
+void jit_compile(Block *b) {}
+
+#endif
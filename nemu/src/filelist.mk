@@ -26,3 +26,7 @@ ASFLAGS += -DBIN_PATH=\"$(mainargs)\"
 endif
 SRCS-$(CONFIG_TARGET_AM) += src/am-bin.S
 .PHONY: src/am-bin.S
+
+ifndef CONFIG_CHECKPOINT
+SRCS-BLACKLIST-y += src/monitor/checkpoint.c
+endif
@@ -15,3 +15,22 @@
 
 INC_PATH += $(NEMU_HOME)/src/isa/$(GUEST_ISA)/include
 DIRS-y += src/isa/$(GUEST_ISA)
+
+ifdef CONFIG_INSTPAT_TREE
+INSTPAT_TREE_PATH = $(NEMU_HOME)/tools/instpat-tree
+INSTPAT_TREE = $(INSTPAT_TREE_PATH)/build/instpat-tree
+INSTPAT_TREE_H = $(NEMU_HOME)/build/gen-$(GUEST_ISA)/inst-tree.h
+
+$(INSTPAT_TREE): $(INSTPAT_TREE_PATH)/instpat-tree.c
+	+$(Q)$(MAKE) $(silent) -C $(INSTPAT_TREE_PATH)
+
+$(INSTPAT_TREE_H): $(NEMU_HOME)/src/isa/$(GUEST_ISA)/inst.c $(INSTPAT_TREE)
+	@echo + GEN $@
+	@mkdir -p $(dir $@)
+	@$(INSTPAT_TREE) $< $@
+
+# Generate the header before compiling inst.c. The generator depends on
+# inst.c by its absolute path, so make does not see a circular dependency.
+src/isa/$(GUEST_ISA)/inst.c: | $(INSTPAT_TREE_H)
+%/src/isa/$(GUEST_ISA)/inst.o: CFLAGS += -include $(INSTPAT_TREE_H)
+endif
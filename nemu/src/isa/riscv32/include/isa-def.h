@@ -21,6 +21,7 @@
 typedef struct {
   word_t gpr[MUXDEF(CONFIG_RVE, 16, 32)];
   vaddr_t pc;
+  word_t satp; // write it with satp_write() to keep the TLB consistent
 } MUXDEF(CONFIG_RV64, riscv64_CPU_state, riscv32_CPU_state);
 
 // decode
@@ -28,6 +29,19 @@ typedef struct {
   uint32_t inst;
 } MUXDEF(CONFIG_RV64, riscv64_ISADecodeInfo, riscv32_ISADecodeInfo);
 
-#define isa_mmu_check(vaddr, len, type) (MMU_DIRECT)
+// pre-decoded instruction
+typedef struct {
+  vaddr_t pc;
+  uint32_t inst;
+  uint8_t type, rd, rs1, rs2;
+  word_t imm;
+  const void *handler; // execution body of the matched pattern
+} MUXDEF(CONFIG_RV64, riscv64_DecodeOp, riscv32_DecodeOp);
+
+// satp.MODE is Bare (0) or Sv32 (1) / Sv39 (8)
+#define SATP_MODE(satp) MUXDEF(CONFIG_RV64, ((satp) >> 60), ((satp) >> 31))
+#define isa_mmu_check(vaddr, len, type) (SATP_MODE(cpu.satp) == 0 ? MMU_DIRECT : MMU_TRANSLATE)
+// the address space of the translation, including the ASID
+#define isa_mmu_ctx() (cpu.satp)
 
 #endif
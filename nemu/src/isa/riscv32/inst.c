@@ -17,6 +17,7 @@
 #include <cpu/cpu.h>
 #include <cpu/ifetch.h>
 #include <cpu/decode.h>
+#include <cpu/event.h>
 
 #define R(i) gpr(i)
 #define Mr vaddr_read
@@ -47,32 +48,159 @@ static void decode_operand(Decode *s, int *rd, word_t *src1, word_t *src2, word_
   }
 }
 
-static int decode_exec(Decode *s) {
+#ifdef CONFIG_DECODE_OP
+// If not NULL, the decoding result of the instruction matched by
+// pattern matching is recorded here for later re-execution.
+static DecodeOp *op_rec = NULL;
+
+static void record_op(Decode *s, int type, int rd, word_t imm, const void *handler) {
+  uint32_t i = s->isa.inst;
+  DecodeOp *op = op_rec;
+  if (op == NULL) return;
+  op->pc = s->pc;
+  op->inst = i;
+  op->type = type;
+  op->rd = rd;
+  op->rs1 = BITS(i, 19, 15);
+  op->rs2 = BITS(i, 24, 20);
+  op->imm = imm;
+  op->handler = handler;
+}
+
+static void decode_op(DecodeOp *op, int *rd, word_t *src1, word_t *src2, word_t *imm) {
+  int rs1 = op->rs1;
+  int rs2 = op->rs2;
+  *rd     = op->rd;
+  *imm    = op->imm;
+  switch (op->type) {
+    case TYPE_I: src1R();          break;
+    case TYPE_S: src1R(); src2R(); break;
+    default: break;
+  }
+}
+#else
+typedef struct DecodeOp DecodeOp;
+#endif
+
+#ifdef CONFIG_DECODE_CACHE
+// A direct-mapped cache of decoding results indexed by pc. A hit skips
+// instruction fetching and pattern matching, and jumps to the execution
+// body of the matched INSTPAT directly.
+#define DCACHE_SIZE (1 << CONFIG_DECODE_CACHE_BITS)
+#define DCACHE_IDX(pc) (((pc) >> 2) & (DCACHE_SIZE - 1))
+#define DCACHE_INVALID ((vaddr_t)1) // never a legal pc
+
+static DecodeOp dcache[DCACHE_SIZE] = {};
+uint64_t g_dcache_hit = 0, g_dcache_miss = 0;
+
+void isa_dcache_flush() {
+  int i;
+  for (i = 0; i < DCACHE_SIZE; i ++) {
+    dcache[i].pc = DCACHE_INVALID;
+  }
+}
+
+void isa_dcache_invalidate(vaddr_t addr, int len) {
+  vaddr_t pc;
+  for (pc = addr & ~(vaddr_t)0x3; pc < addr + len; pc += 4) {
+    DecodeOp *e = &dcache[DCACHE_IDX(pc)];
+    if (e->pc == pc) e->pc = DCACHE_INVALID;
+  }
+}
+#endif
+
+#ifdef CONFIG_ENGINE_BLOCK
+// Threaded dispatch: after executing the body of an op, jump to the body
+// of the next op in the block directly, as long as the control flow
+// falls through and nothing requires returning to the main loop.
+#define dispatch_next_op() do { \
+  if (nr_exec < nr_op && s->dnpc == s->snpc && \
+      nemu_state.state == NEMU_RUNNING && !g_block_flushed) { \
+    R(0) = 0; \
+    cpu.pc = s->dnpc; \
+    op ++; \
+    nr_exec ++; \
+    s->pc = op->pc; \
+    s->snpc = s->pc + 4; \
+    s->dnpc = s->snpc; \
+    s->isa.inst = op->inst; \
+    decode_op(op, &rd, &src1, &src2, &imm); \
+    goto *(op->handler); \
+  } \
+} while (0)
+#endif
+
+// Execute the instruction in `s->isa.inst` by pattern matching if `op` is NULL.
+// Otherwise execute the first `nr_op` pre-decoded ops starting from `op`.
+// Return the number of instructions executed.
+static int decode_exec(Decode *s, DecodeOp *op, int nr_op) {
+  int rd = 0;
+  word_t src1 = 0, src2 = 0, imm = 0;
+  int nr_exec = 1;
   s->dnpc = s->snpc;
 
 #define INSTPAT_INST(s) ((s)->isa.inst)
 #define INSTPAT_MATCH(s, name, type, ... /* execute body */ ) { \
-  int rd = 0; \
-  word_t src1 = 0, src2 = 0, imm = 0; \
   decode_operand(s, &rd, &src1, &src2, &imm, concat(TYPE_, type)); \
+  IFDEF(CONFIG_DECODE_OP, \
+    record_op(s, concat(TYPE_, type), rd, imm, &&concat(__instpat_exec_, __LINE__)); \
+    concat(__instpat_exec_, __LINE__): ;) \
   __VA_ARGS__ ; \
+  IFDEF(CONFIG_ENGINE_BLOCK, dispatch_next_op()); \
 }
 
   INSTPAT_START();
+#ifdef CONFIG_DECODE_OP
+  if (op != NULL) {
+    decode_op(op, &rd, &src1, &src2, &imm);
+    goto *(op->handler);
+  }
+#endif
   INSTPAT("??????? ????? ????? ??? ????? 00101 11", auipc  , U, R(rd) = s->pc + imm);
   INSTPAT("??????? ????? ????? 100 ????? 00000 11", lbu    , I, R(rd) = Mr(src1 + imm, 1));
   INSTPAT("??????? ????? ????? 000 ????? 01000 11", sb     , S, Mw(src1 + imm, 1, src2));
 
+  INSTPAT("??????? ????? ????? 001 ????? 00011 11", fence.i, N, IFDEF(CONFIG_DECODE_CACHE, isa_dcache_flush()); IFDEF(CONFIG_ENGINE_BLOCK, block_flush()));
+  INSTPAT("0001001 ????? ????? 000 00000 11100 11", sfence.vma, N, tlb_flush());
+  INSTPAT("0001000 00101 00000 000 00000 11100 11", wfi    , N, event_idle());
   INSTPAT("0000000 00001 00000 000 00000 11100 11", ebreak , N, NEMUTRAP(s->pc, R(10))); // R(10) is $a0
   INSTPAT("??????? ????? ????? ??? ????? ????? ??", inv    , N, INV(s->pc));
   INSTPAT_END();
 
   R(0) = 0; // reset $zero to 0
 
-  return 0;
+  return nr_exec;
 }
 
 int isa_exec_once(Decode *s) {
+#ifdef CONFIG_DECODE_CACHE
+  DecodeOp *e = &dcache[DCACHE_IDX(s->pc)];
+  if (likely(e->pc == s->pc)) {
+    g_dcache_hit ++;
+    s->isa.inst = e->inst;
+    s->snpc += 4;
+    return decode_exec(s, e, 1);
+  }
+  g_dcache_miss ++;
+  op_rec = e;
+#endif
   s->isa.inst = inst_fetch(&s->snpc, 4);
-  return decode_exec(s);
+  return decode_exec(s, NULL, 0);
+}
+
+#ifdef CONFIG_ENGINE_BLOCK
+int isa_exec_record(Decode *s, DecodeOp *op) {
+  op_rec = op;
+  s->isa.inst = inst_fetch(&s->snpc, 4);
+  int ret = decode_exec(s, NULL, 0);
+  op_rec = NULL;
+  return ret;
+}
+
+int isa_exec_ops(Decode *s, DecodeOp *op, int nr_op) {
+  s->pc = op->pc;
+  s->snpc = s->pc + 4;
+  s->isa.inst = op->inst;
+  return decode_exec(s, op, nr_op);
 }
+#endif
@@ -12,11 +12,68 @@
 *
 * See the Mulan PSL v2 for more details.
 ***************************************************************************************/
-
 #include <isa.h>
 #include <memory/vaddr.h>
 #include <memory/paddr.h>
+#include "../local-include/reg.h"
+
+#ifdef CONFIG_RV64
+// Sv39
+#define LEVELS   3
+#define VPN_BITS 9
+#define PTE_SIZE 8
+#define SATP_PPN(satp) BITS(satp, 43, 0)
+#else
+// Sv32
+#define LEVELS   2
+#define VPN_BITS 10
+#define PTE_SIZE 4
+#define SATP_PPN(satp) BITS(satp, 21, 0)
+#endif
+
+enum { PTE_V = 0x1, PTE_R = 0x2, PTE_W = 0x4, PTE_X = 0x8,
+  PTE_U = 0x10, PTE_G = 0x20, PTE_A = 0x40, PTE_D = 0x80 };
+#define PTE_PPN(pte) ((pte) >> 10)
+
+void satp_write(word_t val) {
+  cpu.satp = val;
+  tlb_flush();
+}
 
+// Return the guest physical page of `vaddr` with MEM_RET_OK in the page offset,
+// or MEM_RET_FAIL on a page fault.
 paddr_t isa_mmu_translate(vaddr_t vaddr, int len, int type) {
+  if ((vaddr & PAGE_MASK) + len > PAGE_SIZE) return MEM_RET_CROSS_PAGE;
+#ifdef CONFIG_RV64
+  // bits 63..39 must all equal to bit 38
+  if ((word_t)((int64_t)(vaddr << 25) >> 25) != vaddr) return MEM_RET_FAIL;
+#endif
+
+  paddr_t pt = (paddr_t)SATP_PPN(cpu.satp) << PAGE_SHIFT;
+  int level;
+  for (level = LEVELS - 1; level >= 0; level --) {
+    int shift = PAGE_SHIFT + level * VPN_BITS;
+    paddr_t pte_addr = pt + ((vaddr >> shift) & ((1 << VPN_BITS) - 1)) * PTE_SIZE;
+    word_t pte = paddr_read(pte_addr, PTE_SIZE);
+    if (!(pte & PTE_V) || (!(pte & PTE_R) && (pte & PTE_W))) return MEM_RET_FAIL;
+
+    if (pte & (PTE_R | PTE_X)) {
+      // leaf PTE, there are no privilege modes yet so the U bit is not checked
+      bool ok = (type == MEM_TYPE_IFETCH ? (pte & PTE_X) :
+                 type == MEM_TYPE_READ   ? (pte & PTE_R) : (pte & PTE_W));
+      if (!ok) return MEM_RET_FAIL;
+      word_t ppn = PTE_PPN(pte);
+      word_t superpage_mask = ((word_t)1 << (level * VPN_BITS)) - 1;
+      if (ppn & superpage_mask) return MEM_RET_FAIL; // misaligned superpage
+
+      // update A/D bits by hardware
+      word_t new_pte = pte | PTE_A | (type == MEM_TYPE_WRITE ? PTE_D : 0);
+      if (new_pte != pte) paddr_write(pte_addr, PTE_SIZE, new_pte);
+
+      ppn |= (vaddr >> PAGE_SHIFT) & superpage_mask;
+      return ((paddr_t)ppn << PAGE_SHIFT) | MEM_RET_OK;
+    }
+    pt = (paddr_t)PTE_PPN(pte) << PAGE_SHIFT;
+  }
   return MEM_RET_FAIL;
 }
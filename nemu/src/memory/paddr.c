@@ -15,10 +15,13 @@
 
 #include <memory/host.h>
 #include <memory/paddr.h>
+#include <memory/vaddr.h>
 #include <device/mmio.h>
+#include <device/map.h>
+#include <cpu/cpu.h>
 #include <isa.h>
 
-#if   defined(CONFIG_PMEM_MALLOC)
+#if   defined(CONFIG_PMEM_MALLOC) || defined(CONFIG_PMEM_MMAP)
 static uint8_t *pmem = NULL;
 #else // CONFIG_PMEM_GARRAY
 static uint8_t pmem[CONFIG_MSIZE] PG_ALIGN = {};
@@ -27,6 +30,188 @@ static uint8_t pmem[CONFIG_MSIZE] PG_ALIGN = {};
 uint8_t* guest_to_host(paddr_t paddr) { return pmem + paddr - CONFIG_MBASE; }
 paddr_t host_to_guest(uint8_t *haddr) { return haddr - pmem + CONFIG_MBASE; }
 
+// A flat table over the physical address space with an entry for each page.
+// A RAM-like page (pmem, or device memory without a callback) maps to its host
+// page, so accessing it takes one lookup and one load. A page used by a single
+// device maps to the device, tagged with PT_MAP. Other pages, such as those
+// shared by several devices or above 4GB, go through the slow path.
+#define NR_PTABLE (1ul << (32 - PAGE_SHIFT))
+#define PT_MAP    ((uintptr_t)1) // host pages are at least 2-byte aligned
+#define PT_SLOW   PT_MAP         // tagged, but without a device
+
+static uintptr_t ptable[NR_PTABLE] = {};
+
+static inline uintptr_t ptable_entry(paddr_t addr) {
+  IFDEF(PMEM64, if (unlikely(addr >> 32)) return PT_SLOW);
+  return ptable[addr >> PAGE_SHIFT];
+}
+
+static inline bool pt_is_host(uintptr_t e) { return e != 0 && !(e & PT_MAP); }
+
+// Route accesses to [low, high] to `host` directly where a whole page is
+// covered, or through `map` otherwise.
+static void ptable_add(paddr_t low, paddr_t high, uint8_t *host, IOMap *map) {
+  uint64_t p, last = (uint64_t)high >> PAGE_SHIFT;
+  if (last >= NR_PTABLE) last = NR_PTABLE - 1;
+  for (p = low >> PAGE_SHIFT; p <= last; p ++) {
+    paddr_t pl = p << PAGE_SHIFT, ph = pl + PAGE_MASK;
+    uint8_t *h = (host != NULL && pl >= low && ph <= high) ? host + (pl - low) : NULL;
+    uintptr_t e;
+    if (ptable[p] != 0) e = PT_SLOW; // shared with another region
+    else if (h != NULL && !((uintptr_t)h & PT_MAP)) e = (uintptr_t)h;
+    else if (map != NULL) e = (uintptr_t)map | PT_MAP;
+    else e = PT_SLOW;
+    ptable[p] = e;
+  }
+}
+
+void paddr_add_map(IOMap *map) {
+  // difftest must skip accesses to devices, so never bypass the map there
+  bool direct = map->callback == NULL && !MUXDEF(CONFIG_DIFFTEST, true, false);
+  ptable_add(map->low, map->high, direct ? map->space : NULL, map);
+}
+
+uint8_t* paddr_host(paddr_t addr) {
+  uintptr_t e = ptable_entry(addr);
+  if (pt_is_host(e)) return (uint8_t *)e + (addr & PAGE_MASK);
+  return (in_pmem(addr) ? guest_to_host(addr) : NULL);
+}
+
+// above this length, throwing all decoded code away is cheaper than
+// checking each word
+#define DMA_INVALIDATE_MAX (64 * 1024)
+
+void paddr_dma_write(paddr_t addr, uint64_t len) {
+  if (len == 0) return;
+  // the caches are indexed by pc, which is the physical address only
+  // when there is no translation
+  if (isa_mmu_check(addr, 1, MEM_TYPE_IFETCH) != MMU_DIRECT || len > DMA_INVALIDATE_MAX) {
+    IFDEF(CONFIG_DECODE_CACHE, isa_dcache_flush());
+    IFDEF(CONFIG_ENGINE_BLOCK, block_flush());
+    return;
+  }
+  IFDEF(CONFIG_DECODE_CACHE, isa_dcache_invalidate(addr, len));
+  IFDEF(CONFIG_ENGINE_BLOCK, block_invalidate(addr, len));
+}
+
+#ifdef CONFIG_PMEM_MMAP
+#include <sys/mman.h>
+#include <signal.h>
+
+#define PMEM_ALIGN (2ul * 1024 * 1024) // the size of a huge page
+
+#ifdef CONFIG_MEM_RANDOM
+// pmem is mapped inaccessible at first. The first touch to a chunk faults,
+// then the chunk is made accessible and filled with random data, so startup
+// does not scale with CONFIG_MSIZE. Accesses by the host kernel, such as
+// read() into pmem, fail with EFAULT instead of faulting, so the chunks are
+// touched by pmem_prefault() before them.
+#define PMEM_CHUNK PMEM_ALIGN
+
+static uint64_t pmem_seed = 0;
+static bool *pmem_chunk_touched = NULL;
+static struct sigaction old_segv_action;
+
+static void pmem_fill(uint8_t *chunk, size_t size) {
+  uint64_t x = pmem_seed ^ (chunk - pmem), *p = (uint64_t *)chunk;
+  size_t i;
+  for (i = 0; i < size / sizeof(*p); i ++) {
+    // xorshift64*, rand() is not async-signal-safe
+    x ^= x >> 12; x ^= x << 25; x ^= x >> 27;
+    p[i] = x * 0x2545f4914f6cdd1dull;
+  }
+}
+
+// make the chunk accessible and fill it, this is async-signal-safe
+static bool pmem_touch_chunk(size_t idx) {
+  uint8_t *chunk = pmem + idx * PMEM_CHUNK;
+  size_t size = pmem + CONFIG_MSIZE - chunk;
+  if (size > PMEM_CHUNK) size = PMEM_CHUNK;
+  if (mprotect(chunk, size, PROT_READ | PROT_WRITE) != 0) return false;
+  pmem_fill(chunk, size);
+  pmem_chunk_touched[idx] = true;
+  return true;
+}
+
+static void pmem_fault_handler(int sig, siginfo_t *info, void *ucontext) {
+  uint8_t *addr = info->si_addr;
+  if (addr >= pmem && addr < pmem + CONFIG_MSIZE) {
+    size_t idx = (addr - pmem) / PMEM_CHUNK;
+    if (!pmem_chunk_touched[idx] && pmem_touch_chunk(idx)) return;
+  }
+  // not a first touch, pass it to the handler installed before
+  if (old_segv_action.sa_flags & SA_SIGINFO) {
+    old_segv_action.sa_sigaction(sig, info, ucontext);
+  } else if (old_segv_action.sa_handler != SIG_DFL && old_segv_action.sa_handler != SIG_IGN) {
+    old_segv_action.sa_handler(sig);
+  } else {
+    // the faulting access is retried with the default action
+    signal(SIGSEGV, SIG_DFL);
+  }
+}
+#endif
+
+static uint8_t* pmem_mmap() {
+  size_t size = CONFIG_MSIZE + PMEM_ALIGN;
+  int prot = MUXDEF(CONFIG_MEM_RANDOM, PROT_NONE, PROT_READ | PROT_WRITE);
+  uint8_t *p = mmap(NULL, size, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  Assert(p != MAP_FAILED, "Can not map physical memory of size 0x%lx", (unsigned long)CONFIG_MSIZE);
+  // align to a huge page and trim the rest
+  uint8_t *ret = (uint8_t *)ROUNDUP(p, PMEM_ALIGN);
+  if (ret != p) munmap(p, ret - p);
+  munmap(ret + CONFIG_MSIZE, p + size - (ret + CONFIG_MSIZE));
+  IFDEF(CONFIG_PMEM_HUGEPAGE, madvise(ret, CONFIG_MSIZE, MADV_HUGEPAGE));
+
+#ifdef CONFIG_MEM_RANDOM
+  pmem_seed = ((uint64_t)rand() << 32) | rand() | 1;
+  pmem_chunk_touched = calloc((CONFIG_MSIZE + PMEM_CHUNK - 1) / PMEM_CHUNK, sizeof(bool));
+  assert(pmem_chunk_touched);
+  struct sigaction s;
+  memset(&s, 0, sizeof(s));
+  s.sa_sigaction = pmem_fault_handler;
+  s.sa_flags = SA_SIGINFO | SA_NODEFER;
+  int r = sigaction(SIGSEGV, &s, &old_segv_action);
+  Assert(r == 0, "Can not set signal handler");
+  // untouched chunks are not saved in checkpoints, but filled from the seed
+  checkpoint_add("pmem seed", &pmem_seed, sizeof(pmem_seed), NULL);
+#endif
+  return ret;
+}
+#endif
+
+void pmem_prefault(paddr_t addr, uint64_t len) {
+#if defined(CONFIG_PMEM_MMAP) && defined(CONFIG_MEM_RANDOM)
+  if (len == 0 || !in_pmem(addr)) return;
+  uint64_t off = addr - CONFIG_MBASE, end = off + len;
+  if (end > CONFIG_MSIZE) end = CONFIG_MSIZE;
+  size_t idx;
+  for (idx = off / PMEM_CHUNK; idx * PMEM_CHUNK < end; idx ++) {
+    if (!pmem_chunk_touched[idx]) {
+      bool ok = pmem_touch_chunk(idx);
+      Assert(ok, "Can not map physical memory at " FMT_PADDR, (paddr_t)(CONFIG_MBASE + idx * PMEM_CHUNK));
+    }
+  }
+#endif
+}
+
+bool pmem_touched(paddr_t addr) {
+#if defined(CONFIG_PMEM_MMAP) && defined(CONFIG_MEM_RANDOM)
+  return pmem_chunk_touched[(addr - CONFIG_MBASE) / PMEM_CHUNK];
+#else
+  return true;
+#endif
+}
+
+void pmem_untouch_all() {
+#if defined(CONFIG_PMEM_MMAP) && defined(CONFIG_MEM_RANDOM)
+  int r = mprotect(pmem, CONFIG_MSIZE, PROT_NONE);
+  Assert(r == 0, "Can not unmap physical memory");
+  // the pages are filled again at the next touch
+  madvise(pmem, CONFIG_MSIZE, MADV_DONTNEED);
+  memset(pmem_chunk_touched, 0, (CONFIG_MSIZE + PMEM_CHUNK - 1) / PMEM_CHUNK * sizeof(bool));
+#endif
+}
+
 static word_t pmem_read(paddr_t addr, int len) {
   word_t ret = host_read(guest_to_host(addr), len);
   return ret;
@@ -45,20 +230,50 @@ void init_mem() {
 #if   defined(CONFIG_PMEM_MALLOC)
   pmem = malloc(CONFIG_MSIZE);
   assert(pmem);
+#elif defined(CONFIG_PMEM_MMAP)
+  pmem = pmem_mmap();
 #endif
+#ifndef CONFIG_PMEM_MMAP
   IFDEF(CONFIG_MEM_RANDOM, memset(pmem, rand(), CONFIG_MSIZE));
+#endif
+  ptable_add(PMEM_LEFT, PMEM_RIGHT, pmem, NULL);
   Log("physical memory area [" FMT_PADDR ", " FMT_PADDR "]", PMEM_LEFT, PMEM_RIGHT);
 }
 
-word_t paddr_read(paddr_t addr, int len) {
-  if (likely(in_pmem(addr))) return pmem_read(addr, len);
-  IFDEF(CONFIG_DEVICE, return mmio_read(addr, len));
+static word_t paddr_read_slow(paddr_t addr, int len, uintptr_t e) {
+  if (in_pmem(addr)) return pmem_read(addr, len);
+#ifdef CONFIG_DEVICE
+  if (e != PT_SLOW && e != 0) {
+    difftest_skip_ref();
+    return map_read(addr, len, (IOMap *)(e & ~PT_MAP));
+  }
+  return mmio_read(addr, len);
+#endif
   out_of_bound(addr);
   return 0;
 }
 
-void paddr_write(paddr_t addr, int len, word_t data) {
-  if (likely(in_pmem(addr))) { pmem_write(addr, len, data); return; }
-  IFDEF(CONFIG_DEVICE, mmio_write(addr, len, data); return);
+static void paddr_write_slow(paddr_t addr, int len, word_t data, uintptr_t e) {
+  if (in_pmem(addr)) { pmem_write(addr, len, data); return; }
+#ifdef CONFIG_DEVICE
+  if (e != PT_SLOW && e != 0) {
+    difftest_skip_ref();
+    map_write(addr, len, data, (IOMap *)(e & ~PT_MAP));
+    return;
+  }
+  mmio_write(addr, len, data); return;
+#endif
   out_of_bound(addr);
 }
+
+word_t paddr_read(paddr_t addr, int len) {
+  uintptr_t e = ptable_entry(addr);
+  if (likely(pt_is_host(e))) return host_read((uint8_t *)e + (addr & PAGE_MASK), len);
+  return paddr_read_slow(addr, len, e);
+}
+
+void paddr_write(paddr_t addr, int len, word_t data) {
+  uintptr_t e = ptable_entry(addr);
+  if (likely(pt_is_host(e))) { host_write((uint8_t *)e + (addr & PAGE_MASK), len, data); return; }
+  paddr_write_slow(addr, len, data, e);
+}
@@ -12,18 +12,127 @@
 *
 * See the Mulan PSL v2 for more details.
 ***************************************************************************************/
-
 #include <isa.h>
+#include <cpu/cpu.h>
+#include <memory/host.h>
 #include <memory/paddr.h>
+#include <memory/vaddr.h>
+
+#ifdef CONFIG_TLB
+// A direct-mapped TLB for each type of access. An entry maps a guest virtual
+// page in an address space to the guest physical page, and to the host page
+// if it is RAM-like. Entries are filled by page walks on misses.
+#define TLB_SIZE (1 << CONFIG_TLB_BITS)
+#define TLB_IDX(vaddr) (((vaddr) >> PAGE_SHIFT) & (TLB_SIZE - 1))
+#define TLB_INVALID ((vaddr_t)1) // never page-aligned
+
+typedef struct {
+  vaddr_t vpage;
+  word_t ctx;
+  paddr_t ppage;
+  uint8_t *host; // NULL if the page is not RAM-like
+} TLBEntry;
+
+static TLBEntry tlb[3][TLB_SIZE] = {}; // indexed by MEM_TYPE_*
+uint64_t g_tlb_hit[3] = {}, g_tlb_miss[3] = {};
+#endif
+
+// The translation has changed, drop everything derived from it.
+void tlb_flush() {
+#ifdef CONFIG_TLB
+  int t, i;
+  for (t = 0; t < 3; t ++) {
+    for (i = 0; i < TLB_SIZE; i ++) tlb[t][i].vpage = TLB_INVALID;
+  }
+#endif
+  // decoded instructions are indexed by virtual pc
+  IFDEF(CONFIG_DECODE_CACHE, isa_dcache_flush());
+  IFDEF(CONFIG_ENGINE_BLOCK, block_flush());
+}
+
+static paddr_t page_walk(vaddr_t vaddr, int type) {
+  paddr_t ret = isa_mmu_translate(vaddr, 1, type);
+  if ((ret & PAGE_MASK) != MEM_RET_OK) {
+    // isa_raise_intr() does not deliver exceptions in this tree, so a guest
+    // page fault can not be handled by the guest and ends the run
+    panic("page fault at vaddr = " FMT_WORD " (type = %d) at pc = " FMT_WORD,
+        vaddr, type, cpu.pc);
+  }
+  return ret & ~(paddr_t)PAGE_MASK;
+}
+
+// Return the host address of `addr` if it is RAM-like, or NULL and the
+// guest physical address in `*paddr`. The access does not cross pages.
+static inline uint8_t* translate(vaddr_t addr, int type, paddr_t *paddr) {
+#ifdef CONFIG_TLB
+  TLBEntry *e = &tlb[type][TLB_IDX(addr)];
+  vaddr_t vpage = addr & ~(vaddr_t)PAGE_MASK;
+  if (likely(e->vpage == vpage && e->ctx == isa_mmu_ctx())) {
+    g_tlb_hit[type] ++;
+  } else {
+    g_tlb_miss[type] ++;
+    e->vpage = vpage;
+    e->ctx = isa_mmu_ctx();
+    e->ppage = page_walk(addr, type);
+    e->host = paddr_host(e->ppage);
+  }
+  if (e->host != NULL) return e->host + (addr & PAGE_MASK);
+  *paddr = e->ppage | (addr & PAGE_MASK);
+#else
+  *paddr = page_walk(addr, type) | (addr & PAGE_MASK);
+#endif
+  return NULL;
+}
+
+static inline bool cross_page(vaddr_t addr, int len) {
+  return (addr & PAGE_MASK) + len > PAGE_SIZE;
+}
+
+static void check_translate(vaddr_t addr, int len, int type) {
+  if (isa_mmu_check(addr, len, type) != MMU_TRANSLATE) {
+    panic("invalid access at vaddr = " FMT_WORD " at pc = " FMT_WORD, addr, cpu.pc);
+  }
+}
+
+static word_t vaddr_read_translate(vaddr_t addr, int len, int type) {
+  check_translate(addr, len, type);
+  if (unlikely(cross_page(addr, len))) {
+    word_t ret = 0;
+    int i;
+    for (i = len - 1; i >= 0; i --) ret = (ret << 8) | vaddr_read_translate(addr + i, 1, type);
+    return ret;
+  }
+  paddr_t paddr;
+  uint8_t *host = translate(addr, type, &paddr);
+  return (host != NULL ? host_read(host, len) : paddr_read(paddr, len));
+}
+
+static void vaddr_write_translate(vaddr_t addr, int len, word_t data) {
+  check_translate(addr, len, MEM_TYPE_WRITE);
+  if (unlikely(cross_page(addr, len))) {
+    int i;
+    for (i = 0; i < len; i ++, data >>= 8) vaddr_write_translate(addr + i, 1, data & 0xff);
+    return;
+  }
+  paddr_t paddr;
+  uint8_t *host = translate(addr, MEM_TYPE_WRITE, &paddr);
+  if (host != NULL) host_write(host, len, data);
+  else paddr_write(paddr, len, data);
+}
 
 word_t vaddr_ifetch(vaddr_t addr, int len) {
-  return paddr_read(addr, len);
+  if (likely(isa_mmu_check(addr, len, MEM_TYPE_IFETCH) == MMU_DIRECT)) return paddr_read(addr, len);
+  return vaddr_read_translate(addr, len, MEM_TYPE_IFETCH);
 }
 
 word_t vaddr_read(vaddr_t addr, int len) {
-  return paddr_read(addr, len);
+  if (likely(isa_mmu_check(addr, len, MEM_TYPE_READ) == MMU_DIRECT)) return paddr_read(addr, len);
+  return vaddr_read_translate(addr, len, MEM_TYPE_READ);
 }
 
 void vaddr_write(vaddr_t addr, int len, word_t data) {
-  paddr_write(addr, len, data);
+  IFDEF(CONFIG_DECODE_CACHE, isa_dcache_invalidate(addr, len));
+  IFDEF(CONFIG_ENGINE_BLOCK, block_invalidate(addr, len));
+  if (likely(isa_mmu_check(addr, len, MEM_TYPE_WRITE) == MMU_DIRECT)) { paddr_write(addr, len, data); return; }
+  vaddr_write_translate(addr, len, data);
 }
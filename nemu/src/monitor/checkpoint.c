@@ -0,0 +1,319 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <utils.h>
+#include <cpu/event.h>
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
+
+extern uint64_t g_nr_guest_inst;
+
+// A checkpoint is a list of named regions. Each region is stored as records
+// of pages, so that all-zero pages cost nothing but a run length, and other
+// pages are compressed with a small LZ77 codec. Pages of pmem never touched
+// by the guest are not stored at all, and are filled again from the saved
+// seed of random memory when the checkpoint is loaded.
+//
+//   file   := magic isa region* end
+//   region := name size record* RECORD_END
+//   record := idx len=0 count        (a run of zero pages)
+//           | idx len<PAGE lz-data   (a compressed page)
+//           | idx len=PAGE raw-data  (an incompressible page)
+
+#define CKPT_MAGIC  "NEMUCKP1"
+#define CKPT_PAGE   4096
+#define RECORD_END  UINT32_MAX
+#define NR_REGION   32
+
+typedef struct {
+  const char *name;
+  uint8_t *addr;
+  size_t size;
+  checkpoint_hook_t after_load;
+} Region;
+
+static Region regions[NR_REGION] = {};
+static int nr_region = 0;
+
+void checkpoint_add(const char *name, void *addr, size_t size, checkpoint_hook_t after_load) {
+  int i;
+  for (i = 0; i < nr_region; i ++) {
+    if (strcmp(regions[i].name, name) == 0) break;
+  }
+  if (i == nr_region) {
+    Assert(nr_region < NR_REGION, "too many checkpoint regions");
+    nr_region ++;
+  }
+  regions[i] = (Region){ .name = name, .addr = addr, .size = size, .after_load = after_load };
+}
+
+static Region* find_region(const char *name) {
+  int i;
+  for (i = 0; i < nr_region; i ++) {
+    if (strcmp(regions[i].name, name) == 0) return &regions[i];
+  }
+  return NULL;
+}
+
+// ----------- LZ77 codec -----------
+// A sequence is a token (literal length : 4, match length - LZ_MIN_MATCH : 4),
+// extra literal length bytes, literals, a 16-bit offset and extra match length
+// bytes. A nibble of 15 is continued by bytes up to 255. The last sequence has
+// only literals.
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+
+static uint8_t* lz_put_len(uint8_t *op, uint8_t *oend, size_t len) {
+  for (; len >= 255; len -= 255) {
+    if (op == oend) return NULL;
+    *op ++ = 255;
+  }
+  if (op == oend) return NULL;
+  *op ++ = len;
+  return op;
+}
+
+static bool lz_get_len(const uint8_t **ip, const uint8_t *iend, size_t *len) {
+  int b;
+  do {
+    if (*ip == iend) return false;
+    b = *(*ip) ++;
+    *len += b;
+  } while (b == 255);
+  return true;
+}
+
+static uint8_t* lz_put_seq(uint8_t *op, uint8_t *oend, const uint8_t *lit, size_t nr_lit,
+    size_t off, size_t match) {
+  size_t ml = (match == 0 ? 0 : match - LZ_MIN_MATCH);
+  if (op == oend) return NULL;
+  *op ++ = (nr_lit < 15 ? nr_lit : 15) << 4 | (ml < 15 ? ml : 15);
+  if (nr_lit >= 15 && (op = lz_put_len(op, oend, nr_lit - 15)) == NULL) return NULL;
+  if (oend - op < nr_lit) return NULL;
+  memcpy(op, lit, nr_lit);
+  op += nr_lit;
+  if (match == 0) return op;
+  if (oend - op < 2) return NULL;
+  *op ++ = off & 0xff;
+  *op ++ = off >> 8;
+  if (ml >= 15 && (op = lz_put_len(op, oend, ml - 15)) == NULL) return NULL;
+  return op;
+}
+
+// Return the compressed size, or 0 if it does not fit in `cap` bytes.
+static size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+  uint16_t table[1 << LZ_HASH_BITS] = {};
+  const uint8_t *ip = src, *anchor = src, *iend = src + n;
+  uint8_t *op = dst, *oend = dst + cap;
+  assert(n <= 65536);
+  while (ip + LZ_MIN_MATCH <= iend) {
+    uint32_t v;
+    memcpy(&v, ip, 4);
+    uint32_t h = (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+    const uint8_t *ref = src + table[h];
+    table[h] = ip - src;
+    if (ref >= ip || memcmp(ref, ip, LZ_MIN_MATCH) != 0) { ip ++; continue; }
+    size_t match = LZ_MIN_MATCH;
+    while (ip + match < iend && ref[match] == ip[match]) match ++;
+    op = lz_put_seq(op, oend, anchor, ip - anchor, ip - ref, match);
+    if (op == NULL) return 0;
+    ip += match;
+    anchor = ip;
+  }
+  op = lz_put_seq(op, oend, anchor, iend - anchor, 0, 0);
+  return (op == NULL ? 0 : op - dst);
+}
+
+static bool lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t size) {
+  const uint8_t *ip = src, *iend = src + n;
+  uint8_t *op = dst, *oend = dst + size;
+  while (ip < iend) {
+    int token = *ip ++;
+    size_t nr_lit = token >> 4, match = token & 0xf;
+    if (nr_lit == 15 && !lz_get_len(&ip, iend, &nr_lit)) return false;
+    if (iend - ip < nr_lit || oend - op < nr_lit) return false;
+    memcpy(op, ip, nr_lit);
+    op += nr_lit;
+    ip += nr_lit;
+    if (ip == iend) break;
+    if (iend - ip < 2) return false;
+    size_t off = ip[0] | ip[1] << 8;
+    ip += 2;
+    if (match == 15 && !lz_get_len(&ip, iend, &match)) return false;
+    match += LZ_MIN_MATCH;
+    if (off == 0 || off > op - dst || oend - op < match) return false;
+    for (; match > 0; match --, op ++) *op = op[-off]; // may overlap
+  }
+  return op == oend;
+}
+
+// ----------- save -----------
+
+static bool is_zero(const uint8_t *p, size_t n) {
+  size_t i;
+  for (i = 0; i < n; i ++) {
+    if (p[i] != 0) return false;
+  }
+  return true;
+}
+
+static bool page_touched(Region *r, size_t off) {
+  if (r->addr == guest_to_host(PMEM_LEFT)) return pmem_touched(PMEM_LEFT + off);
+  return true;
+}
+
+static void put_u32(FILE *fp, uint32_t v) { fwrite(&v, sizeof(v), 1, fp); }
+static void put_u64(FILE *fp, uint64_t v) { fwrite(&v, sizeof(v), 1, fp); }
+
+static void put_str(FILE *fp, const char *s) {
+  put_u32(fp, strlen(s));
+  fwrite(s, strlen(s), 1, fp);
+}
+
+static size_t page_size(Region *r, uint32_t idx) {
+  size_t rest = r->size - (size_t)idx * CKPT_PAGE;
+  return (rest < CKPT_PAGE ? rest : CKPT_PAGE);
+}
+
+static void put_zero_run(FILE *fp, uint32_t start, uint32_t *nr_zero) {
+  if (*nr_zero == 0) return;
+  put_u32(fp, start);
+  put_u32(fp, 0);
+  put_u32(fp, *nr_zero);
+  *nr_zero = 0;
+}
+
+static void save_region(FILE *fp, Region *r) {
+  static uint8_t buf[CKPT_PAGE];
+  uint32_t idx, nr_page = (r->size + CKPT_PAGE - 1) / CKPT_PAGE;
+  uint32_t zero_start = 0, nr_zero = 0;
+  put_str(fp, r->name);
+  put_u64(fp, r->size);
+  for (idx = 0; idx < nr_page; idx ++) {
+    size_t off = (size_t)idx * CKPT_PAGE, size = page_size(r, idx);
+    uint8_t *page = r->addr + off;
+    bool touched = page_touched(r, off);
+    if (touched && is_zero(page, size)) {
+      if (nr_zero ++ == 0) zero_start = idx;
+      continue;
+    }
+    put_zero_run(fp, zero_start, &nr_zero);
+    if (!touched) continue;
+    size_t len = lz_compress(page, size, buf, size - 1);
+    put_u32(fp, idx);
+    if (len == 0) { put_u32(fp, size); fwrite(page, size, 1, fp); }
+    else { put_u32(fp, len); fwrite(buf, len, 1, fp); }
+  }
+  put_zero_run(fp, zero_start, &nr_zero);
+  put_u32(fp, RECORD_END);
+}
+
+bool checkpoint_save(const char *file) {
+  FILE *fp = fopen(file, "wb");
+  if (fp == NULL) { Log("Can not open '%s'", file); return false; }
+  fwrite(CKPT_MAGIC, strlen(CKPT_MAGIC), 1, fp);
+  put_str(fp, str(__GUEST_ISA__));
+  int i;
+  for (i = 0; i < nr_region; i ++) save_region(fp, &regions[i]);
+  put_u32(fp, 0); // no more regions
+  bool ok = !ferror(fp);
+  ok = (fclose(fp) == 0) && ok;
+  if (ok) Log("Save checkpoint to %s", file);
+  else Log("Can not write checkpoint to %s", file);
+  return ok;
+}
+
+// ----------- load -----------
+
+static bool get_u32(FILE *fp, uint32_t *v) { return fread(v, sizeof(*v), 1, fp) == 1; }
+static bool get_u64(FILE *fp, uint64_t *v) { return fread(v, sizeof(*v), 1, fp) == 1; }
+
+static bool get_str(FILE *fp, char *buf, size_t cap) {
+  uint32_t len;
+  if (!get_u32(fp, &len) || len >= cap) return false;
+  buf[len] = '\0';
+  return len == 0 || fread(buf, len, 1, fp) == 1;
+}
+
+static bool load_region(FILE *fp, Region *r) {
+  static uint8_t buf[CKPT_PAGE];
+  uint32_t idx, len, nr_page = (r->size + CKPT_PAGE - 1) / CKPT_PAGE;
+  // pages with records are touched again when they are written below
+  if (r->addr == guest_to_host(PMEM_LEFT)) pmem_untouch_all();
+  while (get_u32(fp, &idx)) {
+    if (idx == RECORD_END) return true;
+    if (idx >= nr_page || !get_u32(fp, &len)) return false;
+    size_t off = (size_t)idx * CKPT_PAGE, size = page_size(r, idx);
+    uint8_t *page = r->addr + off;
+    if (len == 0) {
+      uint32_t nr_zero;
+      if (!get_u32(fp, &nr_zero) || nr_zero > nr_page - idx) return false;
+      size_t n = (size_t)nr_zero * CKPT_PAGE;
+      memset(page, 0, (n < r->size - off ? n : r->size - off));
+      continue;
+    }
+    if (len > size) return false;
+    if (len == size) {
+      // an uncompressed page is read in place
+      if (r->addr == guest_to_host(PMEM_LEFT)) pmem_prefault(PMEM_LEFT + off, size);
+      if (fread(page, size, 1, fp) != 1) return false;
+    } else if (fread(buf, len, 1, fp) != 1 || !lz_decompress(buf, len, page, size)) {
+      return false;
+    }
+  }
+  return false;
+}
+
+bool checkpoint_load(const char *file) {
+  FILE *fp = fopen(file, "rb");
+  if (fp == NULL) { Log("Can not open '%s'", file); return false; }
+  char buf[64];
+  uint64_t old_nr_guest_inst = g_nr_guest_inst;
+  bool ok = fread(buf, strlen(CKPT_MAGIC), 1, fp) == 1 &&
+    memcmp(buf, CKPT_MAGIC, strlen(CKPT_MAGIC)) == 0;
+  if (!ok) { Log("%s is not a checkpoint", file); goto out; }
+  ok = get_str(fp, buf, sizeof(buf)) && strcmp(buf, str(__GUEST_ISA__)) == 0;
+  if (!ok) { Log("%s is not a checkpoint of %s", file, str(__GUEST_ISA__)); goto out; }
+
+  while ((ok = get_str(fp, buf, sizeof(buf))) && buf[0] != '\0') {
+    uint64_t size;
+    Region *r = find_region(buf);
+    ok = get_u64(fp, &size) && r != NULL && r->size == size;
+    if (!ok) { Log("region '%s' does not match this machine", buf); goto out; }
+    ok = load_region(fp, r);
+    if (!ok) { Log("region '%s' is corrupted", buf); goto out; }
+    if (r->after_load != NULL) r->after_load();
+  }
+
+  // everything derived from the old memory and translation is stale
+  tlb_flush();
+  // keep pending events the same distance away
+  event_shift(g_nr_guest_inst - old_nr_guest_inst);
+  nemu_state.state = NEMU_STOP;
+  Log("Load checkpoint from %s, guest instructions = %" PRIu64 ", pc = " FMT_WORD,
+      file, g_nr_guest_inst, cpu.pc);
+out:
+  fclose(fp);
+  return ok;
+}
+
+void init_checkpoint() {
+  checkpoint_add("cpu", &cpu, sizeof(cpu), NULL);
+  checkpoint_add("guest inst", &g_nr_guest_inst, sizeof(g_nr_guest_inst), NULL);
+  checkpoint_add("icount bias", &g_icount_bias, sizeof(g_icount_bias), NULL);
+  checkpoint_add("pmem", guest_to_host(PMEM_LEFT), CONFIG_MSIZE, NULL);
+}
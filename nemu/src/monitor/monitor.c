@@ -23,6 +23,9 @@ void init_difftest(char *ref_so_file, long img_size, int port);
 void init_device();
 void init_sdb();
 void init_disasm();
+void init_checkpoint();
+void init_vga_record(const char *file);
+void init_key_record(const char *record_file, const char *replay_file);
 
 static void welcome() {
   Log("Trace: %s", MUXDEF(CONFIG_TRACE, ANSI_FMT("ON", ANSI_FG_GREEN), ANSI_FMT("OFF", ANSI_FG_RED)));
@@ -42,6 +45,10 @@ void sdb_set_batch_mode();
 static char *log_file = NULL;
 static char *diff_so_file = NULL;
 static char *img_file = NULL;
+static char *restore_file = NULL;
+static char *vga_record_file = NULL;
+static char *record_input_file = NULL;
+static char *replay_input_file = NULL;
 static int difftest_port = 1234;
 
 static long load_img() {
@@ -58,7 +65,9 @@ static long load_img() {
 
   Log("The image is %s, size = %ld", img_file, size);
 
+  Assert(size <= PMEM_RIGHT - RESET_VECTOR + 1, "The image is larger than physical memory");
   fseek(fp, 0, SEEK_SET);
+  pmem_prefault(RESET_VECTOR, size);
   int ret = fread(guest_to_host(RESET_VECTOR), size, 1, fp);
   assert(ret == 1);
 
@@ -72,16 +81,29 @@ static int parse_args(int argc, char *argv[]) {
     {"log"      , required_argument, NULL, 'l'},
     {"diff"     , required_argument, NULL, 'd'},
     {"port"     , required_argument, NULL, 'p'},
+    {"restore"  , required_argument, NULL, 'r'},
+    {"icount"   , required_argument, NULL, 'i'},
+    {"vga-record", required_argument, NULL, 'v'},
+    {"record-input", required_argument, NULL, 'R'},
+    {"replay-input", required_argument, NULL, 'P'},
     {"help"     , no_argument      , NULL, 'h'},
     {0          , 0                , NULL,  0 },
   };
   int o;
-  while ( (o = getopt_long(argc, argv, "-bhl:d:p:", table, NULL)) != -1) {
+  while ( (o = getopt_long(argc, argv, "-bhl:d:p:r:i:v:", table, NULL)) != -1) {
     switch (o) {
       case 'b': sdb_set_batch_mode(); break;
       case 'p': sscanf(optarg, "%d", &difftest_port); break;
       case 'l': log_file = optarg; break;
       case 'd': diff_so_file = optarg; break;
+      case 'r': restore_file = optarg; break;
+      case 'i':
+        sscanf(optarg, "%d", &g_icount_shift);
+        Assert(g_icount_shift >= 0 && g_icount_shift <= 10, "--icount should be in [0, 10]");
+        break;
+      case 'v': vga_record_file = optarg; break;
+      case 'R': record_input_file = optarg; break;
+      case 'P': replay_input_file = optarg; break;
       case 1: img_file = optarg; return 0;
       default:
         printf("Usage: %s [OPTION...] IMAGE [args]\n\n", argv[0]);
@@ -89,6 +111,11 @@ static int parse_args(int argc, char *argv[]) {
         printf("\t-l,--log=FILE           output log to FILE\n");
         printf("\t-d,--diff=REF_SO        run DiffTest with reference REF_SO\n");
         printf("\t-p,--port=PORT          run DiffTest with port PORT\n");
+        printf("\t-r,--restore=FILE       restore the machine from checkpoint FILE\n");
+        printf("\t-i,--icount=N           each instruction takes 2^N ns of deterministic guest time\n");
+        printf("\t-v,--vga-record=FILE    record the changed screen tiles to FILE (headless VGA)\n");
+        printf("\t   --record-input=FILE  record the keys read by the guest to FILE\n");
+        printf("\t   --replay-input=FILE  replay the keys recorded in FILE instead of the keyboard\n");
         printf("\n");
         exit(0);
     }
@@ -113,6 +140,17 @@ void init_monitor(int argc, char *argv[]) {
 
   /* Initialize devices. */
   IFDEF(CONFIG_DEVICE, init_device());
+#ifdef CONFIG_VGA_HEADLESS
+  if (vga_record_file != NULL) init_vga_record(vga_record_file);
+#else
+  Assert(vga_record_file == NULL, "--vga-record requires CONFIG_VGA_HEADLESS");
+#endif
+#ifdef CONFIG_HAS_KEYBOARD
+  init_key_record(record_input_file, replay_input_file);
+#else
+  Assert(record_input_file == NULL && replay_input_file == NULL,
+      "--record-input and --replay-input require CONFIG_HAS_KEYBOARD");
+#endif
 
   /* Perform ISA dependent initialization. */
   init_isa();
@@ -120,6 +158,17 @@ void init_monitor(int argc, char *argv[]) {
   /* Load the image to memory. This will overwrite the built-in image. */
   long img_size = load_img();
 
+#ifdef CONFIG_CHECKPOINT
+  /* Restore the machine from a checkpoint. This will overwrite the image. */
+  init_checkpoint();
+  if (restore_file != NULL) {
+    bool ok = checkpoint_load(restore_file);
+    Assert(ok, "Can not restore from checkpoint '%s'", restore_file);
+  }
+#else
+  Assert(restore_file == NULL, "Checkpoints are not enabled in menuconfig");
+#endif
+
   /* Initialize differential testing. */
   init_difftest(diff_so_file, img_size, difftest_port);
 
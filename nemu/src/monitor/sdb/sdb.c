@@ -100,7 +100,7 @@ static int cmd_x(char *args){
     int len = 0;
     paddr_t addr = 0;
     sscanf(n, "%d", &len);
-    sscanf(baseaddr,"%x", &addr);
+    sscanf(baseaddr, "%" MUXDEF(PMEM64, SCNx64, SCNx32), &addr);
     for(int i = 0 ; i < len ; i ++)
     {
         printf("%x\n",paddr_read(addr,4));
@@ -183,6 +183,20 @@ static int cmd_t(char *args) {
   return 0;
 }
 
+#ifdef CONFIG_CHECKPOINT
+static int cmd_save(char *args) {
+  if (args == NULL) printf("Usage: save FILE\n");
+  else checkpoint_save(args);
+  return 0;
+}
+
+static int cmd_load(char *args) {
+  if (args == NULL) printf("Usage: load FILE\n");
+  else checkpoint_load(args);
+  return 0;
+}
+#endif
+
 static struct {
   const char *name;
   const char *description;
@@ -198,7 +212,11 @@ static struct {
   { "w","add watchpoint",cmd_w},
   { "d","delete watchpoint",cmd_d},
   { "info","print watchpoint information",cmd_info},
-  { "t", "Generate and evaluate a random expression",cmd_t}
+  { "t", "Generate and evaluate a random expression",cmd_t},
+#ifdef CONFIG_CHECKPOINT
+  { "save", "Save the machine to a checkpoint file", cmd_save },
+  { "load", "Restore the machine from a checkpoint file", cmd_load },
+#endif
   /* TODO: Add more commands */
 };
 
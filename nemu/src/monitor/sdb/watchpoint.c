@@ -98,6 +98,10 @@ void check_watchpoints(){
   }
 }
 
+bool has_watchpoint() {
+  return head != NULL;
+}
+
 void info_watchpoints(){
   WP* wp = head;
   if(wp == NULL){
@@ -44,6 +44,20 @@ uint64_t get_time() {
   return now - boot_time;
 }
 
+int g_icount_shift = -1;
+uint64_t g_icount_bias = 0;
+
+uint64_t get_guest_time() {
+  extern uint64_t g_nr_guest_inst;
+  if (g_icount_shift < 0) return get_time();
+  return ((g_nr_guest_inst + g_icount_bias) << g_icount_shift) / 1000;
+}
+
+uint64_t icount_from_us(uint64_t us) {
+  uint64_t n = (us * 1000) >> g_icount_shift;
+  return (n == 0 ? 1 : n);
+}
+
 void init_rand() {
   srand(get_time_internal());
 }
@@ -0,0 +1,317 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+/* Generate decision-tree decoders from the INSTPAT tables in inst.c.
+ *
+ * For each table, a macro `INSTPAT_DISPATCH_<line>` is generated for the
+ * first INSTPAT in it. It switches on fields of the instruction and jumps to
+ * the label of the matched INSTPAT, which is defined by the INSTPAT macro
+ * in include/cpu/decode.h. The macros for other INSTPATs are empty.
+ *
+ * Patterns which can never be matched since earlier patterns cover them
+ * are reported as errors, and partially overlapping patterns as warnings.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+
+#define MAX_PAT 1024
+#define MAX_LINE 4096
+#define MAX_WINDOW 8 // at most 256 cases in a switch
+#define MAX_LINEAR 2 // test these many patterns one by one
+
+typedef struct {
+  uint64_t key, mask;
+  int line;
+  char name[32];
+  bool reached;
+  bool shadowed;
+} Pattern;
+
+static Pattern pat[MAX_PAT];
+static int nr_pat = 0;
+static const char *src = NULL;
+static FILE *out = NULL;
+static int nr_error = 0;
+
+__attribute__((format(printf, 2, 3)))
+static void emit(int depth, const char *fmt, ...) {
+  fprintf(out, "%*s", depth * 2 + 2, "");
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(out, fmt, ap);
+  va_end(ap);
+  fprintf(out, " \\\n");
+}
+
+static bool parse_pattern(const char *p, Pattern *pt) {
+  int len = 0;
+  pt->key = pt->mask = 0;
+  for (; *p != '"'; p ++) {
+    if (*p == ' ') continue;
+    if (*p != '0' && *p != '1' && *p != '?') return false;
+    if (++ len > 64) return false;
+    pt->key  = (pt->key  << 1) | (*p == '1');
+    pt->mask = (pt->mask << 1) | (*p != '?');
+  }
+  return len > 0;
+}
+
+static int nr_untested(uint64_t mask, uint64_t tested) {
+  return __builtin_popcountll(mask & ~tested);
+}
+
+// patterns in `cand` which can match when the field at `lo` of width `w` is `v`
+static int filter(const int *cand, int n, int lo, int w, uint64_t v, int *child) {
+  uint64_t wmask = (1ull << w) - 1;
+  int i, nr = 0;
+  for (i = 0; i < n; i ++) {
+    Pattern *p = &pat[cand[i]];
+    if ((((p->key >> lo) ^ v) & (p->mask >> lo) & wmask) == 0) child[nr ++] = cand[i];
+  }
+  return nr;
+}
+
+static void emit_goto(int depth, Pattern *p) {
+  p->reached = true;
+  emit(depth, "goto __instpat_%d;", p->line);
+}
+
+// Choose a field among the untested fixed bits of the first candidate,
+// which minimizes the largest group of candidates after switching on it,
+// and then the average size of the groups.
+static void choose_field(const int *cand, int n, uint64_t tested, int *lo, int *w) {
+  uint64_t fixed = pat[cand[0]].mask & ~tested;
+  int *child = malloc(sizeof(int) * n);
+  int best_max = n + 1, best_sum = 0;
+  *w = 0;
+  int i;
+  for (i = 0; i < 64; i ++) {
+    if (!(fixed >> i & 1)) continue;
+    int width = 0;
+    while (width < MAX_WINDOW && i + width < 64 && (fixed >> (i + width) & 1)) width ++;
+    int max = 0, sum = 0;
+    uint64_t v;
+    for (v = 0; v < (1ull << width); v ++) {
+      int nr = filter(cand, n, i, width, v, child);
+      if (nr > max) max = nr;
+      sum += nr;
+    }
+    if (max < best_max || (max == best_max && ((uint64_t)sum << *w) < ((uint64_t)best_sum << width))) {
+      best_max = max; best_sum = sum; *lo = i; *w = width;
+    }
+  }
+  free(child);
+}
+
+static void emit_node(const int *cand, int n, uint64_t tested, int depth) {
+  if (n == 0) { emit(depth, "goto *(__instpat_end);"); return; }
+  if (nr_untested(pat[cand[0]].mask, tested) == 0) { emit_goto(depth, &pat[cand[0]]); return; }
+
+  int i;
+  if (n <= MAX_LINEAR) {
+    for (i = 0; i < n; i ++) {
+      Pattern *p = &pat[cand[i]];
+      uint64_t m = p->mask & ~tested;
+      if (m == 0) { emit_goto(depth, p); return; }
+      p->reached = true;
+      emit(depth, "if ((__instpat_inst & 0x%llxull) == 0x%llxull) goto __instpat_%d;",
+          (unsigned long long)m, (unsigned long long)(p->key & m), p->line);
+    }
+    emit(depth, "goto *(__instpat_end);");
+    return;
+  }
+
+  int lo = 0, w = 0;
+  choose_field(cand, n, tested, &lo, &w);
+  int nr_v = 1 << w;
+  int *child = malloc(sizeof(int) * n * nr_v);
+  int *nr_child = malloc(sizeof(int) * nr_v);
+  int *group = malloc(sizeof(int) * nr_v); // the first value with the same candidates
+  int v;
+  for (v = 0; v < nr_v; v ++) {
+    nr_child[v] = filter(cand, n, lo, w, v, child + v * n);
+    for (group[v] = 0; group[v] < v; group[v] ++) {
+      int g = group[v];
+      if (nr_child[g] == nr_child[v] &&
+          memcmp(child + g * n, child + v * n, sizeof(int) * nr_child[v]) == 0) break;
+    }
+  }
+
+  // the largest group goes to `default`
+  int dflt = 0, dflt_size = 0;
+  for (v = 0; v < nr_v; v ++) {
+    if (group[v] != v) continue;
+    int size = 0, u;
+    for (u = v; u < nr_v; u ++) size += (group[u] == v);
+    if (size > dflt_size) { dflt = v; dflt_size = size; }
+  }
+
+  uint64_t child_tested = tested | (((1ull << w) - 1) << lo);
+  emit(depth, "switch ((__instpat_inst >> %d) & 0x%x) {", lo, nr_v - 1);
+  for (v = 0; v < nr_v; v ++) {
+    if (group[v] != v || v == dflt) continue;
+    int u;
+    for (u = v; u < nr_v; u ++) {
+      if (group[u] == v) emit(depth, "  case 0x%x:", u);
+    }
+    emit_node(child + v * n, nr_child[v], child_tested, depth + 2);
+  }
+  emit(depth, "  default:");
+  emit_node(child + dflt * n, nr_child[dflt], child_tested, depth + 2);
+  emit(depth, "}");
+
+  free(child);
+  free(nr_child);
+  free(group);
+}
+
+static void check_table(Pattern *t, int n) {
+  int i, j;
+  for (j = 0; j < n; j ++) {
+    for (i = 0; i < j; i ++) {
+      Pattern *a = &t[i], *b = &t[j];
+      if (((a->key ^ b->key) & a->mask & b->mask) != 0) continue; // disjoint
+      if ((a->mask & ~b->mask) == 0) {
+        fprintf(stderr, "%s:%d: error: pattern '%s' is shadowed by '%s' at line %d\n",
+            src, b->line, b->name, a->name, a->line);
+        nr_error ++;
+        b->shadowed = true;
+        break;
+      }
+      // a more specific pattern before a general one is intended
+      if ((b->mask & ~a->mask) != 0) {
+        fprintf(stderr, "%s:%d: warning: pattern '%s' overlaps with '%s' at line %d, which takes precedence\n",
+            src, b->line, b->name, a->name, a->line);
+      }
+    }
+  }
+}
+
+static void gen_table(int first) {
+  Pattern *t = &pat[first];
+  int n = nr_pat - first;
+  if (n == 0) return;
+  check_table(t, n);
+
+  int *cand = malloc(sizeof(int) * n);
+  int i;
+  for (i = 0; i < n; i ++) cand[i] = first + i;
+  fprintf(out, "#define INSTPAT_DISPATCH_%d { \\\n", t[0].line);
+  if (nr_untested(t[0].mask, 0) > 0) {
+    emit(0, "uint64_t __instpat_inst = (uint64_t)INSTPAT_INST(s);");
+  }
+  emit_node(cand, n, 0, 0);
+  fprintf(out, "}\n");
+  for (i = 1; i < n; i ++) fprintf(out, "#define INSTPAT_DISPATCH_%d\n", t[i].line);
+  fprintf(out, "\n");
+  free(cand);
+
+  for (i = 0; i < n; i ++) {
+    if (!t[i].reached && !t[i].shadowed) {
+      fprintf(stderr, "%s:%d: error: pattern '%s' can never be matched\n", src, t[i].line, t[i].name);
+      nr_error ++;
+    }
+  }
+}
+
+static void error(int line, const char *msg) {
+  fprintf(stderr, "%s:%d: error: %s\n", src, line, msg);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    fprintf(stderr, "Usage: %s inst.c output.h\n", argv[0]);
+    return 1;
+  }
+  src = argv[1];
+  FILE *fp = fopen(src, "r");
+  if (fp == NULL) { perror(src); return 1; }
+
+  char tmp[MAX_LINE];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", argv[2]);
+  out = fopen(tmp, "w");
+  if (out == NULL) { perror(tmp); return 1; }
+  fprintf(out, "// Generated by tools/instpat-tree from %s, do not edit.\n\n", src);
+  fprintf(out, "#define INSTPAT_TREE 1\n\n");
+
+  static char buf[MAX_LINE];
+  int line = 0, first = -1, if_depth = 0, table_if_depth = 0;
+  bool in_comment = false;
+  while (fgets(buf, sizeof(buf), fp)) {
+    line ++;
+    char *p = buf;
+    if (in_comment) {
+      char *end = strstr(p, "*/");
+      if (end == NULL) continue;
+      p = end + 2;
+      in_comment = false;
+    }
+    while (isspace(*p)) p ++;
+    if (strncmp(p, "/*", 2) == 0 && strstr(p, "*/") == NULL) { in_comment = true; continue; }
+
+    if (*p == '#') {
+      p ++;
+      while (isspace(*p)) p ++;
+      if (strncmp(p, "if", 2) == 0) if_depth ++;
+      else if (strncmp(p, "endif", 5) == 0) if_depth --;
+      continue;
+    }
+
+    if (strncmp(p, "INSTPAT_START(", 14) == 0) {
+      if (first >= 0) error(line, "nested INSTPAT_START");
+      first = nr_pat;
+      table_if_depth = if_depth;
+    } else if (strncmp(p, "INSTPAT_END(", 12) == 0) {
+      if (first < 0) error(line, "INSTPAT_END without INSTPAT_START");
+      gen_table(first);
+      first = -1;
+    } else if (strncmp(p, "INSTPAT(\"", 9) == 0) {
+      if (first < 0) error(line, "INSTPAT outside INSTPAT_START/INSTPAT_END");
+      if (if_depth != table_if_depth) error(line, "INSTPAT inside a preprocessor conditional is not supported");
+      if (nr_pat == MAX_PAT) error(line, "too many patterns");
+      Pattern *pt = &pat[nr_pat];
+      // the tree refers to an INSTPAT by the line it starts on, which is only
+      // the line seen by __LINE__ when the pattern and the name are on it
+      char *quote = strchr(p + 9, '"');
+      if (quote == NULL) error(line, "the pattern string must end on the line where INSTPAT starts");
+      if (!parse_pattern(p + 9, pt)) error(line, "invalid pattern string");
+      char *name = quote + 1;
+      while (isspace(*name) || *name == ',') name ++;
+      int len = strspn(name, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_.");
+      if (len == 0) error(line, "the name must be on the line where INSTPAT starts");
+      if (len >= sizeof(pt->name)) len = sizeof(pt->name) - 1;
+      memcpy(pt->name, name, len);
+      pt->name[len] = '\0';
+      pt->line = line;
+      pt->reached = false;
+      pt->shadowed = false;
+      nr_pat ++;
+    }
+  }
+  if (first >= 0) error(line, "INSTPAT_START without INSTPAT_END");
+  fclose(fp);
+  fclose(out);
+
+  if (nr_error > 0) { remove(tmp); return 1; }
+  if (rename(tmp, argv[2]) != 0) { perror(argv[2]); return 1; }
+  return 0;
+}